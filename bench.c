@@ -0,0 +1,1471 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pg.h>
+
+// Checks and timings behind the library's performance work.
+// Exits non-zero if any check fails.
+
+static int  failures;
+
+static double now(void) {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void check(bool ok, const char *what) {
+    printf("%-48s %s\n", what, ok? "ok": "FAILED");
+    failures += !ok;
+}
+
+static void timing(const char *what, double seconds) {
+    printf("%-48s %8.3f ms\n", what, seconds * 1e3);
+}
+
+static bool samepixels(Canvas *a, Canvas *b, int width, int height) {
+    Bitmap  *x = (Bitmap*) a;
+    Bitmap  *y = (Bitmap*) b;
+    for (int i = 0; i < height; i++)
+        if (memcmp(x->pixels + i * x->stride, y->pixels + i * y->stride,
+                width * sizeof *x->pixels))
+            return false;
+    return true;
+}
+
+static void testpattern(Canvas *g) {
+    Bitmap  *bmp = (Bitmap*) g;
+    for (int y = 0; y < g->height; y++)
+        for (int x = 0; x < g->width; x++)
+            bmp->pixels[y * bmp->stride + x] =
+                0xff000000 | (x * 7 & 255) << 16 | (y * 5 & 255) << 8 |
+                ((x ^ y) & 255);
+}
+
+static uint32_t toargb(uint32_t px, int format) {
+    if (format & 1)
+        px = (px & 0xff00ff00) | (px >> 16 & 255) | (px & 255) << 16;
+    unsigned    a = px >> 24;
+    if (format & 2 && a)
+        for (int shift = 0; shift < 24; shift += 8) {
+            unsigned    c = ((px >> shift & 255) * 255 + a / 2) / a;
+            px = (px & ~(255u << shift)) | (c < 255? c: 255) << shift;
+        }
+    return px;
+}
+
+// Largest channel difference once both bitmaps are converted to ARGB.
+static int formatdiff(Canvas *a, Canvas *b, int format) {
+    uint32_t    *p = ((Bitmap*) a)->pixels;
+    uint32_t    *q = ((Bitmap*) b)->pixels;
+    int         most = 0;
+    for (int i = 0; i < a->width * a->height; i++) {
+        uint32_t    x = toargb(q[i], format);
+        for (int shift = 0; shift < 32; shift += 8) {
+            int     d = abs((int) (p[i] >> shift & 255) -
+                        (int) (x >> shift & 255));
+            most = d > most? d: most;
+        }
+    }
+    return most;
+}
+
+// A triangle whose edges cross pixels at many coverages.
+static void triangle(Canvas *g, float scale) {
+    pgmove(g, pt(2.5f * scale, 2.3f * scale));
+    pgline(g, pt(37.2f * scale, 5.1f * scale));
+    pgline(g, pt(19.7f * scale, 37.6f * scale));
+    pgclose(g);
+}
+
+
+/*
+
+    Font warm-up.
+
+*/
+
+
+static void fonts(void) {
+    const char  *text = "Warm-up";
+    Font        *warm = pgfontfile("/usr/share/fonts/TTF/georgia.ttf", 0);
+    Font        *cold = pgfontfile("/usr/share/fonts/TTF/georgia.ttf", 0);
+    if (!warm || !cold) {
+        printf("%-48s %s\n", "font warm-up", "skipped; no font");
+        return;
+    }
+    pgscalefont(warm, 24, 24);
+    pgscalefont(cold, 24, 24);
+
+    double  t = now();
+    pgwarmfont(warm, text, true);
+    pgwaitfont(warm);
+    timing("warm up distance fields for 7 characters", now() - t);
+    check(!warm->warmup && warm->sdf && warm->sdf[warm->mapping['W']],
+        "warm-up finishes and fills the glyph cache");
+
+    Canvas  *a = pgnewbmp(160, 40);
+    Canvas  *b = pgnewbmp(160, 40);
+    pgclear(a, (Colour) { 1, 1, 1, 1 });
+    pgclear(b, (Colour) { 1, 1, 1, 1 });
+    pgsdfstring(a, warm, pt(4, 30), text, (Colour) { 0, 0, 0, 1 });
+    pgsdfstring(b, cold, pt(4, 30), text, (Colour) { 0, 0, 0, 1 });
+    Bitmap  *bmp = (Bitmap*) a;
+    int     inked = 0;
+    for (int i = 0; i < 40; i++)
+        for (int j = 0; j < 160; j++)
+            inked += bmp->pixels[i * bmp->stride + j] != 0xffffffff;
+    check(inked > 0 && samepixels(a, b, 160, 40),
+        "warmed font draws as a cold one");
+
+    pgfree(a);
+    pgfree(b);
+    pgfreefont(warm);
+    pgfreefont(cold);
+}
+
+
+/*
+
+    Gradients.
+
+*/
+
+
+// Blue along a row filled with a black to white ramp over its first 100
+// pixels, repeated or reflected past them.
+static void ramp(int *level, Paint *paint) {
+    Canvas  *g = pgnewbmp(300, 1);
+    pgaddstop(paint, 0, (Colour) { 0, 0, 0, 1 });
+    pgaddstop(paint, 1, (Colour) { 1, 1, 1, 1 });
+    pgmove(g, pt(-1, -1));
+    pgline(g, pt(301, -1));
+    pgline(g, pt(301, 2));
+    pgline(g, pt(-1, 2));
+    pgclose(g);
+    pgfillpaint(g, paint);
+    for (int x = 0; x < 300; x++)
+        level[x] = ((Bitmap*) g)->pixels[x] & 255;
+    pgfreepaint(paint);
+    pgfree(g);
+}
+
+// Where a repeat wraps, black and white are a pixel apart.
+static int seamdiff(int a, int b) {
+    int     d = abs(a - b);
+    return d < 255 - d? d: 255 - d;
+}
+
+static void gradients(void) {
+    int     pad[300];
+    int     repeat[300];
+    int     reflect[300];
+    int     radial[300];
+    ramp(pad, pglinear(pt(0, 0), pt(100, 0), PG_PAD));
+    ramp(repeat, pglinear(pt(0, 0), pt(100, 0), PG_REPEAT));
+    ramp(reflect, pglinear(pt(0, 0), pt(100, 0), PG_REFLECT));
+    ramp(radial, pgradial(pt(0, 0), 100, PG_REPEAT));
+
+    // One step of the ramp is 2.55 levels; allow for a pixel of it.
+    bool    padok = pad[0] < 8 && pad[99] > 247;
+    bool    repeatok = true;
+    bool    reflectok = true;
+    bool    radialok = true;
+    for (int x = 100; x < 300; x++)
+        padok &= pad[x] == 255;
+    for (int x = 0; x < 200; x++)
+        repeatok &= seamdiff(repeat[x + 100], repeat[x]) <= 3
+            && seamdiff(repeat[x], pad[x % 100]) <= 3;
+    for (int d = 1; d < 100; d++)
+        reflectok &= abs(reflect[100 + d] - reflect[100 - d]) <= 3
+            && abs(reflect[200 + d] - reflect[d]) <= 3;
+    for (int x = 0; x < 300; x++)
+        radialok &= seamdiff(radial[x], repeat[x]) <= 3;
+    check(padok, "padded gradient holds its end colours");
+    check(repeatok, "repeated gradient restarts every period");
+    check(reflectok, "reflected gradient mirrors every period");
+    check(radialok, "radial gradient matches linear along a radius");
+}
+
+
+/*
+
+    Image blits.
+
+*/
+
+
+static void blits(void) {
+    Canvas  *src = pgnewbmp(640, 360);
+    Canvas  *dst = pgnewbmp(1920, 1080);
+    IntRect sr = { 0, 0, 640, 360 };
+    IntRect dr = { 0, 0, 1920, 1080 };
+    testpattern(src);
+
+    pgblit(dst, src, sr, sr, PG_NEAREST);
+    check(samepixels(dst, src, 640, 360), "unscaled blit copies pixels");
+
+    double  t = now();
+    for (int i = 0; i < 20; i++)
+        pgblit(dst, src, sr, dr, PG_NEAREST);
+    timing("nearest blit 640x360 to 1920x1080", (now() - t) / 20);
+
+    t = now();
+    for (int i = 0; i < 20; i++)
+        pgblit(dst, src, sr, dr, PG_BILINEAR);
+    timing("bilinear blit 640x360 to 1920x1080", (now() - t) / 20);
+
+    Paint   *pattern = pgpattern(src, (CTM) { 3, 0, 0, 3, 0, 0 },
+                        PG_REPEAT, PG_BILINEAR);
+    t = now();
+    for (int i = 0; i < 20; i++) {
+        pgmove(dst, pt(0, 0));
+        pgline(dst, pt(1920, 0));
+        pgline(dst, pt(1920, 1080));
+        pgline(dst, pt(0, 1080));
+        pgclose(dst);
+        pgfillpaint(dst, pattern);
+    }
+    timing("bilinear pattern fill 1920x1080", (now() - t) / 20);
+
+    pgfreepaint(pattern);
+    pgfree(src);
+    pgfree(dst);
+}
+
+
+/*
+
+    Linear light.
+
+*/
+
+
+// Blue of the first two pixels of a white row after a fill that covers
+// all of the first and half of the second.
+static void overwhite(int *level, Colour colour, bool linear) {
+    Canvas  *g = pgnewbmp(4, 1);
+    pgclear(g, (Colour) { 1, 1, 1, 1 });
+    pggamma(g, linear);
+    pgfillrect(g, colour, (Rect) {{ -1, -1, 1, 2 }});
+    level[0] = ((Bitmap*) g)->pixels[0] & 255;
+    level[1] = ((Bitmap*) g)->pixels[1] & 255;
+    pgfree(g);
+}
+
+static void linearlight(void) {
+    int     srgb[2];
+    int     linear[2];
+    overwhite(srgb, (Colour) { 0, 0, 0, 1 }, false);
+    overwhite(linear, (Colour) { 0, 0, 0, 1 }, true);
+    check(abs(srgb[1] - 0x80) <= 1, "black half over white is 80 in sRGB");
+    check(abs(linear[1] - 0xbc) <= 1,
+        "black half over white is bc in linear light");
+
+    overwhite(srgb, (Colour) { 0.5f, 0.5f, 0.5f, 1 }, false);
+    overwhite(linear, (Colour) { 0.5f, 0.5f, 0.5f, 1 }, true);
+    check(srgb[0] == linear[0], "covered pixels ignore gamma");
+
+    Canvas  *a = pgnewbmp(40, 40);
+    Canvas  *b = pgnewbmp(40, 40);
+    pgclear(a, (Colour) { 1, 1, 1, 1 });
+    pgclear(b, (Colour) { 1, 1, 1, 1 });
+    pggamma(b, true);
+    triangle(a, 1);
+    pgfill(a, (Colour) { 0, 0, 0, 1 });
+    triangle(b, 1);
+    pgfill(b, (Colour) { 0, 0, 0, 1 });
+    uint32_t    *p = ((Bitmap*) a)->pixels;
+    uint32_t    *q = ((Bitmap*) b)->pixels;
+    bool        lighter = true;
+    bool        differ = false;
+    for (int i = 0; i < 40 * 40; i++) {
+        lighter &= (q[i] & 255) >= (p[i] & 255);
+        differ |= q[i] != p[i];
+    }
+    check(lighter && differ, "linear light lightens dark edges");
+
+    pgfree(a);
+    pgfree(b);
+}
+
+
+/*
+
+    Layers.
+
+*/
+
+
+static void layers(void) {
+    Canvas  *g = pgnewbmp(40, 40);
+    pgclear(g, (Colour) { 1, 1, 1, 1 });
+    Canvas  *layer = pgpushlayer(g, (Rect) {{ 0, 0, 40, 40 }});
+    triangle(layer, 1);
+    pgfill(layer, (Colour) { 1, 0, 0, 0.5f });
+    pgpoplayer(layer, 1);
+
+    // Half red over white is never darker than ffff8080, even at edges.
+    bool        ok = true;
+    uint32_t    *p = ((Bitmap*) g)->pixels;
+    for (int i = 0; i < 40 * 40; i++)
+        ok &= (p[i] & 0xffff0000) == 0xffff0000 &&
+            (p[i] >> 8 & 255) >= 0x7f && (p[i] >> 8 & 255) == (p[i] & 255);
+    check(ok, "translucent layer edges have no dark fringe");
+    pgfree(g);
+}
+
+
+/*
+
+    Box trees.
+
+*/
+
+
+static void panel(Box *box, Canvas *g) {
+    pgclear(g, (Colour) { 1, 1, 1, 1 });
+    for (int i = 0; i < 8; i++) {
+        pgmove(g, pt(box->width * 0.5f, box->height * 0.5f));
+        for (int k = 0; k < 12; k++)
+            pgline(g, pt((k * 37 + i * 11) % box->width,
+                (k * 53 + i * 7) % box->height));
+        pgclose(g);
+        pgfill(g, (Colour) { i % 3 / 3.0f, i % 5 / 5.0f, 0.5f, 0.5f });
+    }
+}
+
+static BoxMethods panelmethods = { .draw = panel };
+
+static Box *panelgrid(int rows, int cols, int width, int height) {
+    Box     *root = pgstackbox(false);
+    for (int r = 0; r < rows; r++) {
+        Box     *row = pgstackbox(true);
+        for (int c = 0; c < cols; c++)
+            pgaddbox(row, pgbox(&panelmethods));
+        pgaddbox(root, row);
+    }
+    root->width = width;
+    root->height = height;
+    pgpack(root);
+    return root;
+}
+
+static void dirty(Box *box) {
+    box->clean = false;
+    for (Box *i = box->children; i; i = i->next)
+        dirty(i);
+}
+
+// Draw each box into its own sub-canvas, as pgdrawbox() once did.
+static void subcanvastree(Canvas *g, Box *box) {
+    if (box->_->draw) {
+        Canvas  *sub = pgboxsubcanvas(g, box);
+        box->_->draw(box, sub);
+        pgfree(sub);
+    }
+    for (Box *i = box->children; i; i = i->next)
+        subcanvastree(g, i);
+}
+
+static void nodraw(Box *box, Canvas *g) {
+    (void) box;
+    (void) g;
+}
+
+static void boxtrees(void) {
+    Box     *grid = panelgrid(8, 8, 400, 300);
+    Canvas  *a = pgnewbmp(400, 300);
+    Canvas  *b = pgnewbmp(400, 300);
+    pgdrawbox(a, grid);
+    subcanvastree(b, grid);
+    check(samepixels(a, b, 400, 300), "box tree matches sub-canvas drawing");
+
+    static BoxMethods   chainmethods = { .draw = nodraw };
+    Box     *chain = pgbox(&chainmethods);
+    Box     *last = chain;
+    for (int i = 0; i < 5000; i++) {
+        Box     *child = pgbox(&chainmethods);
+        pgaddbox(last, child);
+        last = child;
+    }
+    chain->width = 100;
+    chain->height = 100;
+    pgpack(chain);
+
+    double  t = now();
+    for (int i = 0; i < 20; i++) {
+        dirty(chain);
+        pgdrawbox(a, chain);
+    }
+    timing("draw a chain of 5000 nested boxes", (now() - t) / 20);
+
+    pgfree(a);
+    pgfree(b);
+}
+
+
+/*
+
+    Compiled paths.
+
+*/
+
+
+// A curved outline, drawn onto g or added to path.
+static const Point  blobpts[] = {
+    { 10, 40 },
+    { 10, 5 }, { 60, 0 }, { 70, 30 },
+    { 80, 60 }, { 40, 45 }, { 30, 70 },
+    { 20, 90 }, { 10, 75 }, { 10, 40 },
+};
+
+static void blob(Canvas *g, Path *path) {
+    const Point *p = blobpts;
+    if (g) {
+        pgmove(g, p[0]);
+        for (int i = 1; i < 10; i += 3)
+            pgcurve4(g, p[i], p[i + 1], p[i + 2]);
+        pgclose(g);
+    } else {
+        pgpmove(path, p[0]);
+        for (int i = 1; i < 10; i += 3)
+            pgpcurve4(path, p[i], p[i + 1], p[i + 2]);
+        pgpclose(path);
+    }
+}
+
+// Fill the blob onto a directly and onto b through cp, both at ctm.
+static void fillboth(Canvas *a, Canvas *b, CompiledPath *cp, CTM ctm) {
+    Colour  colour = { 0.2f, 0.4f, 0.8f, 1 };
+    pgclear(a, (Colour) { 1, 1, 1, 1 });
+    pgclear(b, (Colour) { 1, 1, 1, 1 });
+    pgctm(a, ctm);
+    pgctm(b, ctm);
+    blob(a, 0);
+    pgfill(a, colour);
+    pgfillcompiled(b, cp, colour);
+}
+
+static void compiled(void) {
+    CTM     ctm = { 1.5f, 0.2f, -0.3f, 1.4f, 12, 7 };
+    Canvas  *a = pgnewbmp(160, 160);
+    Canvas  *b = pgnewbmp(160, 160);
+    Path    *path = pgpath(0);
+    blob(0, path);
+    CompiledPath    *cp = pgcompilepath(0, path, ctm);
+
+    fillboth(a, b, cp, ctm);
+    check(samepixels(a, b, 160, 160), "compiled fill matches immediate");
+
+    // Translation only offsets the cached edges, which rounds differently.
+    ctm.e += 20;
+    ctm.f += 30;
+    fillboth(a, b, cp, ctm);
+    check(formatdiff(a, b, PG_ARGB) <= 1, "translated compiled fill matches");
+
+    // Any other change flattens the path again.
+    ctm.a = 1.1f;
+    fillboth(a, b, cp, ctm);
+    check(samepixels(a, b, 160, 160), "rescaled compiled fill matches");
+
+    pgfreecompiled(cp);
+    pgfreepath(path);
+    pgfree(a);
+    pgfree(b);
+}
+
+
+/*
+
+    Transformed paths.
+
+*/
+
+
+static Point transformed(CTM m, Point p) {
+    return pt(m.a * p.x + m.c * p.y + m.e, m.b * p.x + m.d * p.y + m.f);
+}
+
+// A 37-pointed star of lines, then the blob, each through m by hand.
+static void byhand(Canvas *g, CTM m) {
+    for (int i = 0; i < 37; i++) {
+        float   r = i & 1? 20: 45;
+        float   t = i * 6.2832f / 37;
+        Point   p = transformed(m, pt(50 + r * cosf(t), 50 + r * sinf(t)));
+        if (i == 0)
+            pgmove(g, p);
+        else
+            pgline(g, p);
+    }
+    pgclose(g);
+
+    const Point *p = blobpts;
+    pgmove(g, transformed(m, p[0]));
+    for (int i = 1; i < 10; i += 3)
+        pgcurve4(g, transformed(m, p[i]), transformed(m, p[i + 1]),
+            transformed(m, p[i + 2]));
+    pgclose(g);
+}
+
+static void transforms(void) {
+    CTM     identity = { 1, 0, 0, 1, 0, 0 };
+    CTM     m = { 0.9f, 0.8f, -0.7f, 1.1f, 70, 3 };
+    Canvas  *a = pgnewbmp(200, 200);
+    Canvas  *b = pgnewbmp(200, 200);
+    pgclear(a, (Colour) { 1, 1, 1, 1 });
+    pgclear(b, (Colour) { 1, 1, 1, 1 });
+
+    pgctm(a, m);
+    pgctm(b, identity);
+    byhand(a, identity);
+    pgfill(a, (Colour) { 0.6f, 0.1f, 0.3f, 1 });
+    byhand(b, m);
+    pgfill(b, (Colour) { 0.6f, 0.1f, 0.3f, 1 });
+    check(formatdiff(a, b, PG_ARGB) <= 1,
+        "batched transform matches points moved by hand");
+
+    pgfree(a);
+    pgfree(b);
+}
+
+
+/*
+
+    Scanline fills.
+
+*/
+
+
+// Small shapes far apart, filled as one path, then a larger curved one.
+static void sparsescene(Canvas *g) {
+    pgclear(g, (Colour) { 1, 1, 1, 1 });
+    for (int i = 0; i < 12; i++) {
+        float   x = i * 67 % 760;
+        float   y = i * 151 % 560;
+        pgmove(g, pt(x + 2.5f, y + 2.3f));
+        pgline(g, pt(x + 37.2f, y + 5.1f));
+        pgline(g, pt(x + 19.7f, y + 37.6f));
+        pgclose(g);
+    }
+    pgfill(g, (Colour) { 0.1f, 0.5f, 0.2f, 1 });
+
+    pgctm(g, (CTM) { 5, 0, 0, 5, 0, 0 });
+    blob(g, 0);
+    pgfill(g, (Colour) { 0.7f, 0.3f, 0.1f, 0.6f });
+    pgctm(g, (CTM) { 1, 0, 0, 1, 0, 0 });
+}
+
+static void scanlines(void) {
+    Canvas  *a = pgnewbmp(800, 600);
+    Canvas  *b = pgnewbmp(800, 600);
+    pgrasterizer(a, PG_DENSE);
+    pgrasterizer(b, PG_SCANLINE);
+
+    double  t = now();
+    for (int i = 0; i < 20; i++)
+        sparsescene(a);
+    timing("sparse scene, coverage rasterizer", (now() - t) / 20);
+
+    t = now();
+    for (int i = 0; i < 20; i++)
+        sparsescene(b);
+    timing("sparse scene, scanline rasterizer", (now() - t) / 20);
+    check(samepixels(a, b, 800, 600), "scanline fill matches coverage fill");
+
+    pgfree(a);
+    pgfree(b);
+}
+
+
+/*
+
+    Solid spans.
+
+*/
+
+
+// Overlapping shapes with long interiors, wound once and twice.
+static void interiors(Canvas *g) {
+    testpattern(g);
+    pgmove(g, pt(20, 30));
+    pgline(g, pt(380, 10));
+    pgline(g, pt(350, 390));
+    pgline(g, pt(30, 360));
+    pgclose(g);
+    pgmove(g, pt(100, 100.3f));
+    pgline(g, pt(300.6f, 100.3f));
+    pgline(g, pt(300.6f, 250));
+    pgline(g, pt(100, 250));
+    pgclose(g);
+}
+
+static void solidspans(void) {
+    Colour  colour = { 0.2f, 0.4f, 0.6f, 1 };  // Exact in eight bits.
+    Paint   *flat = pglinear(pt(0, 0), pt(1, 0), PG_PAD);
+    pgaddstop(flat, 0, colour);
+    pgaddstop(flat, 1, colour);
+    Canvas  *a = pgnewbmp(400, 400);
+    Canvas  *b = pgnewbmp(400, 400);
+
+    for (int linear = 0; linear < 2; linear++) {
+        pggamma(a, linear);
+        pggamma(b, linear);
+        interiors(a);
+        pgfill(a, colour);
+        interiors(b);
+        pgfillpaint(b, flat);
+        check(samepixels(a, b, 400, 400), linear
+            ? "solid spans match per-pixel paint, linear light"
+            : "solid spans match per-pixel paint");
+    }
+
+    pgfreepaint(flat);
+    pgfree(a);
+    pgfree(b);
+}
+
+
+/*
+
+    Fill rules and aliasing.
+
+*/
+
+
+// A pentagram, whose centre is wound twice.
+static void pentagram(Canvas *g) {
+    pgmove(g, pt(50, 5));
+    for (int i = 1; i <= 5; i++) {
+        float   t = i * 4 * 3.14159265f / 5;
+        pgline(g, pt(50 + 45 * sinf(t), 50 - 45 * cosf(t)));
+    }
+    pgclose(g);
+}
+
+static uint32_t pixel(Canvas *g, int x, int y) {
+    return ((Bitmap*) g)->pixels[y * ((Bitmap*) g)->stride + x];
+}
+
+static void fillrules(void) {
+    Canvas  *a = pgnewbmp(100, 100);
+    Canvas  *b = pgnewbmp(100, 100);
+
+    pgclear(a, (Colour) { 1, 1, 1, 1 });
+    pentagram(a);
+    pgfill(a, (Colour) { 0, 0, 0, 1 });
+    pgclear(b, (Colour) { 1, 1, 1, 1 });
+    pgfillrule(b, PG_EVENODD);
+    pentagram(b);
+    pgfill(b, (Colour) { 0, 0, 0, 1 });
+    check(pixel(a, 50, 50) == 0xff000000 && pixel(b, 50, 50) == 0xffffffff
+        && pixel(b, 50, 15) == 0xff000000,
+        "even-odd leaves the pentagram's centre empty");
+
+    pgrasterizer(a, PG_SCANLINE);
+    pgfillrule(a, PG_EVENODD);
+    pgclear(a, (Colour) { 1, 1, 1, 1 });
+    pentagram(a);
+    pgfill(a, (Colour) { 0, 0, 0, 1 });
+    check(samepixels(a, b, 100, 100),
+        "even-odd scanline fill matches coverage");
+
+    // Aliased pixels are all or nothing, and set where the centre is in.
+    pgrasterizer(a, PG_AUTO);
+    pgfillrule(a, PG_NONZERO);
+    pgfillrule(b, PG_NONZERO);
+    pgantialias(b, false);
+    pgclear(a, (Colour) { 1, 1, 1, 1 });
+    pgclear(b, (Colour) { 1, 1, 1, 1 });
+    triangle(a, 2.5f);
+    pgfill(a, (Colour) { 0, 0, 0, 1 });
+    triangle(b, 2.5f);
+    pgfill(b, (Colour) { 0, 0, 0, 1 });
+    bool    whole = true;
+    bool    centred = true;
+    for (int y = 0; y < 100; y++)
+        for (int x = 0; x < 100; x++) {
+            uint32_t    p = pixel(b, x, y);
+            int         aa = pixel(a, x, y) & 255;
+            whole &= p == 0xff000000 || p == 0xffffffff;
+            centred &= aa > 25 || p == 0xff000000;
+            centred &= aa < 230 || p == 0xffffffff;
+        }
+    check(whole && centred, "aliased fill sets whole pixels by their centres");
+
+    pgrasterizer(a, PG_SCANLINE);
+    pgantialias(a, false);
+    pgclear(a, (Colour) { 1, 1, 1, 1 });
+    triangle(a, 2.5f);
+    pgfill(a, (Colour) { 0, 0, 0, 1 });
+    check(samepixels(a, b, 100, 100), "aliased scanline fill matches coverage");
+
+    pgfree(a);
+    pgfree(b);
+}
+
+
+/*
+
+    Masks.
+
+*/
+
+
+static void masks(void) {
+    Canvas  *mask = pgnewmask(100, 100);
+    Canvas  *a = pgnewbmp(160, 160);
+    Canvas  *b = pgnewbmp(160, 160);
+    Colour  colour = { 0.8f, 0.2f, 0.4f, 1 };
+
+    pgclear(mask, (Colour) { 0, 0, 0, 0 });
+    triangle(mask, 2.5f);
+    pgfill(mask, (Colour) { 0, 0, 0, 1 });
+    uint8_t *m = ((Mask*) mask)->pixels;
+    int     stride = ((Mask*) mask)->stride;
+    check(m[40 * stride + 50] == 255 && m[90 * stride + 90] == 0,
+        "mask holds the shape's coverage");
+
+    // Coverage through the mask is rounded to 256ths.
+    testpattern(a);
+    testpattern(b);
+    pgfillmask(a, mask, 30, 20, colour);
+    pgtranslate(b, 30, 20);
+    triangle(b, 2.5f);
+    pgfill(b, colour);
+    check(formatdiff(a, b, PG_ARGB) <= 1, "mask fill matches a direct fill");
+
+    pgclear(mask, (Colour) { 0, 0, 0, 0 });
+    triangle(mask, 2.5f);
+    pgfill(mask, (Colour) { 0, 0, 0, 0.5f });
+    check(abs(m[40 * stride + 50] - 128) <= 1,
+        "mask draws a colour's alpha");
+
+    pgfree(mask);
+    pgfree(a);
+    pgfree(b);
+}
+
+
+/*
+
+    Pixel formats.
+
+*/
+
+
+static const char   *formatnames[] = { "ARGB", "ABGR", "PARGB", "PABGR" };
+
+static void opaquescene(Canvas *g) {
+    Paint   *ramp = pglinear(pt(0, 0), pt(80, 0), PG_PAD);
+    pgaddstop(ramp, 0, (Colour) { 1, 0, 0, 1 });
+    pgaddstop(ramp, 1, (Colour) { 0, 0, 1, 1 });
+
+    pgclear(g, (Colour) { 1, 1, 1, 1 });
+    pgfillrect(g, (Colour) { 0.9f, 0.2f, 0.1f, 1 }, (Rect) {{ 4, 4, 36, 24 }});
+    triangle(g, 2);
+    pgfillpaint(g, ramp);
+    pgstrokeline(g, 3, (Colour) { 0.2f, 0.3f, 0.9f, 1 }, pt(0, 79), pt(79, 0));
+    pgfreepaint(ramp);
+}
+
+static void formats(void) {
+    char    label[64];
+    for (int linear = 0; linear < 2; linear++) {
+        Canvas  *argb = pgnewbmp(80, 80);
+        pggamma(argb, linear);
+        opaquescene(argb);
+
+        for (int format = PG_ABGR; format <= PG_PABGR; format++) {
+            Canvas  *g = pgpixelformat(pgnewbmp(80, 80), format);
+            pggamma(g, linear);
+            opaquescene(g);
+            snprintf(label, sizeof label, "%s matches ARGB%s",
+                formatnames[format], linear? " in linear light": "");
+            // Straight pixels weigh coverage in 256ths, which near black
+            // in linear light is a few sRGB steps.
+            check(formatdiff(argb, g, format) <= (linear? 8: 2), label);
+            pgfree(g);
+        }
+        pgfree(argb);
+
+        // Premultiplied pixels composite source-over.
+        for (int format = PG_PARGB; format <= PG_PABGR; format++) {
+            Canvas  *g = pgpixelformat(pgnewbmp(40, 40), format);
+            pggamma(g, linear);
+            pgclear(g, (Colour) { 1, 1, 1, 1 });
+            triangle(g, 1);
+            pgfill(g, (Colour) { 1, 0, 0, 0.5f });
+
+            // Half red over white is 80 green inside, bc in linear light,
+            // and no lighter red nor darker green anywhere.
+            uint32_t    *p = ((Bitmap*) g)->pixels;
+            int         inside = toargb(p[10 * 40 + 18], format) >> 8 & 255;
+            bool        ok = abs(inside - (linear? 0xbc: 0x80)) <= 2;
+            for (int i = 0; i < 40 * 40; i++) {
+                uint32_t    px = toargb(p[i], format);
+                ok &= (px & 0xffff0000) == 0xffff0000 &&
+                    (int) (px >> 8 & 255) >= inside - 1 &&
+                    (px >> 8 & 255) == (px & 255);
+            }
+            snprintf(label, sizeof label, "%s half red over white%s",
+                formatnames[format], linear? " in linear light": "");
+            check(ok, label);
+            pgfree(g);
+        }
+    }
+}
+
+
+/*
+
+    Streaming.
+
+*/
+
+
+// The sparse scene with a stroke and a gradient across it.
+static void streamscene(Canvas *g, void *data) {
+    (void) data;
+    Paint   *ramp = pgradial(pt(400, 300), 120, PG_REFLECT);
+    pgaddstop(ramp, 0, (Colour) { 1, 0.8f, 0, 1 });
+    pgaddstop(ramp, 1, (Colour) { 0, 0.2f, 0.7f, 0.5f });
+
+    sparsescene(g);
+    pgstrokeline(g, 3, (Colour) { 0.2f, 0.3f, 0.9f, 1 },
+        pt(0, 599), pt(799, 0));
+    pgmove(g, pt(250, 150));
+    pgline(g, pt(550, 180));
+    pgline(g, pt(420, 470));
+    pgclose(g);
+    pgfillpaint(g, ramp);
+    pgfreepaint(ramp);
+}
+
+static bool collect(const uint32_t *pixels, int width, int height, int y,
+    void *data)
+{
+    Bitmap  *whole = data;
+    for (int i = 0; i < height; i++)
+        memcpy(whole->pixels + (y + i) * whole->stride, pixels + i * width,
+            width * sizeof *pixels);
+    return true;
+}
+
+static void streams(void) {
+    Canvas  *a = pgnewbmp(800, 600);
+    Canvas  *b = pgnewbmp(800, 600);
+    streamscene(a, 0);
+
+    // Strips of 37 rows do not divide the image, and edges cross them.
+    double  t = now();
+    bool    ok = pgstream(800, 600, 37, streamscene, collect, b);
+    timing("stream 800x600 in strips of 37 rows", now() - t);
+    check(ok && samepixels(a, b, 800, 600),
+        "strips match a whole-canvas render");
+
+    pgfree(a);
+    pgfree(b);
+}
+
+
+/*
+
+    Image files.
+
+    Saved files are read back here; the PNG reader knows only the stored
+    and fixed-code blocks and the None and Up filters the writer uses.
+
+*/
+
+
+static uint8_t *readfile(const char *file, size_t *n) {
+    FILE    *f = fopen(file, "rb");
+    uint8_t *data = 0;
+    if (f && !fseek(f, 0, SEEK_END) && (*n = ftell(f)) > 0) {
+        data = malloc(*n);
+        rewind(f);
+        if (data && fread(data, 1, *n, f) != *n) {
+            free(data);
+            data = 0;
+        }
+    }
+    if (f)
+        fclose(f);
+    return data;
+}
+
+static uint32_t be32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint32_t crc(const uint8_t *data, size_t n) {
+    uint32_t    c = ~0u;
+    while (n--) {
+        c ^= *data++;
+        for (int k = 0; k < 8; k++)
+            c = c & 1? 0xedb88320 ^ (c >> 1): c >> 1;
+    }
+    return ~c;
+}
+
+typedef struct {
+    const uint8_t   *in;
+    size_t          n;
+    size_t          bit;
+} Bits;
+
+// Bits least significant first; past the end reads zeros.
+static unsigned getbits(Bits *b, int n) {
+    unsigned    x = 0;
+    for (int i = 0; i < n; i++, b->bit++)
+        if (b->bit >> 3 < b->n)
+            x |= (b->in[b->bit >> 3] >> (b->bit & 7) & 1u) << i;
+    return x;
+}
+
+// Huffman codes are packed most significant bit first.
+static unsigned getcode(Bits *b, int n) {
+    unsigned    x = 0;
+    while (n--)
+        x = x << 1 | getbits(b, 1);
+    return x;
+}
+
+static int fixedsymbol(Bits *b) {
+    unsigned    code = getcode(b, 7);
+    if (code < 0x18)
+        return 256 + code;
+    code = code << 1 | getbits(b, 1);
+    if (code < 0xc0)
+        return code - 0x30;
+    if (code < 0xc8)
+        return 280 + code - 0xc0;
+    return 144 + ((code << 1 | getbits(b, 1)) - 0x190);
+}
+
+// Inflate a zlib stream into out; returns the length or -1.
+static long inflate(const uint8_t *in, size_t n, uint8_t *out, size_t max) {
+    static const uint16_t   lbase[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const uint16_t   dbase[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193,
+        12289, 16385, 24577 };
+    Bits        b = { in, n, 16 };
+    size_t      len = 0;
+    if (n < 6 || (in[0] << 8 | in[1]) % 31)
+        return -1;
+
+    for (bool final = false; !final; ) {
+        final = getbits(&b, 1);
+        int     type = getbits(&b, 2);
+        if (type == 0) {
+            b.bit = (b.bit + 7) & ~(size_t) 7;
+            unsigned    k = getbits(&b, 16);
+            if ((getbits(&b, 16) ^ k) != 0xffff || b.bit / 8 + k > n ||
+                len + k > max)
+                return -1;
+            memcpy(out + len, in + b.bit / 8, k);
+            b.bit += k * 8;
+            len += k;
+        } else if (type == 1)
+            for (int sym; (sym = fixedsymbol(&b)) != 256; ) {
+                if (sym < 256) {
+                    if (len == max)
+                        return -1;
+                    out[len++] = sym;
+                    continue;
+                }
+                if (sym > 285)
+                    return -1;
+                int     lc = sym - 257;
+                int     ln = lbase[lc] + getbits(&b, lc < 8 || lc == 28?
+                                0: (lc - 4) / 4);
+                int     dc = getcode(&b, 5);
+                if (dc > 29)
+                    return -1;
+                size_t  d = dbase[dc] + getbits(&b, dc < 4? 0: (dc - 2) / 2);
+                if (d > len || len + ln > max)
+                    return -1;
+                for (int i = 0; i < ln; i++, len++)
+                    out[len] = out[len - d];
+            }
+        else
+            return -1;
+        if (b.bit > n * 8)
+            return -1;
+    }
+
+    uint32_t    s1 = 1;
+    uint32_t    s2 = 0;
+    for (size_t i = 0; i < len; i++) {
+        s1 = (s1 + out[i]) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+    b.bit = (b.bit + 7) & ~(size_t) 7;
+    return b.bit / 8 + 4 <= n && be32(in + b.bit / 8) == (s2 << 16 | s1)
+        ? (long) len
+        : -1;
+}
+
+// Whether a PPM file holds the canvas's colours.
+static bool sameppm(Canvas *g, const char *file) {
+    Bitmap  *bmp = (Bitmap*) g;
+    size_t  n;
+    uint8_t *data = readfile(file, &n);
+    int     width;
+    int     height;
+    int     head = 0;
+    bool    ok = data &&
+                sscanf((char*) data, "P6\n%d %d\n255\n%n", &width, &height,
+                    &head) == 2 &&
+                head && width == g->width && height == g->height &&
+                n == head + (size_t) width * height * 3;
+    for (int y = 0; ok && y < height; y++)
+        for (int x = 0; ok && x < width; x++) {
+            uint32_t    px = toargb(bmp->pixels[y * bmp->stride + x],
+                            bmp->format);
+            uint8_t     *p = data + head + (y * width + x) * 3;
+            ok = p[0] == (px >> 16 & 255) && p[1] == (px >> 8 & 255) &&
+                 p[2] == (px & 255);
+        }
+    free(data);
+    return ok;
+}
+
+// Whether a PNG file holds the canvas's colours and alpha, with every
+// chunk's CRC intact.
+static bool samepng(Canvas *g, const char *file) {
+    Bitmap  *bmp = (Bitmap*) g;
+    size_t  n;
+    uint8_t *data = readfile(file, &n);
+    uint8_t *idat = malloc(n);
+    size_t  nidat = 0;
+    size_t  rowbytes = (size_t) g->width * 4 + 1;
+    uint8_t *raw = malloc(rowbytes * g->height + 1);
+    bool    ok = data && idat && raw && n >= 8 &&
+                !memcmp(data, "\x89PNG\r\n\x1a\n", 8);
+    bool    end = false;
+
+    for (size_t at = 8; ok && !end; ) {
+        size_t  k = at + 12 <= n? be32(data + at): n;
+        ok = at + 12 + k <= n &&
+             crc(data + at + 4, k + 4) == be32(data + at + 8 + k);
+        if (!ok)
+            break;
+        const uint8_t   *type = data + at + 4;
+        if (!memcmp(type, "IHDR", 4))
+            ok = k == 13 && be32(type + 4) == (uint32_t) g->width &&
+                 be32(type + 8) == (uint32_t) g->height &&
+                 !memcmp(type + 12, "\x08\x06\0\0\0", 5);
+        else if (!memcmp(type, "IDAT", 4)) {
+            memcpy(idat + nidat, type + 4, k);
+            nidat += k;
+        } else
+            end = !memcmp(type, "IEND", 4);
+        at += 12 + k;
+    }
+    ok = ok && end &&
+         inflate(idat, nidat, raw, rowbytes * g->height + 1) ==
+            (long) (rowbytes * g->height);
+
+    for (int y = 0; ok && y < g->height; y++) {
+        uint8_t     *row = raw + y * rowbytes;
+        ok = row[0] == 0 || row[0] == 2;
+        for (int x = 0; ok && x < g->width; x++) {
+            uint8_t     *p = row + 1 + x * 4;
+            if (row[0] == 2 && y)
+                for (int i = 0; i < 4; i++)
+                    p[i] += (p - rowbytes)[i];
+            uint32_t    px = toargb(bmp->pixels[y * bmp->stride + x],
+                            bmp->format);
+            ok = p[0] == (px >> 16 & 255) && p[1] == (px >> 8 & 255) &&
+                 p[2] == (px & 255) && p[3] == px >> 24;
+        }
+    }
+    free(data);
+    free(idat);
+    free(raw);
+    return ok;
+}
+
+static void imagefiles(void) {
+    const char  *file = "bench-image.tmp";
+    Canvas      *g = pgnewbmp(640, 480);
+    Bitmap      *bmp = (Bitmap*) g;
+    testpattern(g);
+    // Vary alpha too, which PNG keeps and PPM drops.
+    for (int y = 0; y < 480; y++)
+        for (int x = 0; x < 640; x++)
+            bmp->pixels[y * bmp->stride + x] =
+                (bmp->pixels[y * bmp->stride + x] & 0xffffff) |
+                (uint32_t) ((x + y) & 255) << 24;
+
+    check(pgsaveimage(g, file, PG_PPM) && sameppm(g, file),
+        "PPM file reads back");
+    check(pgsaveimage(g, file, PG_PNG_STORE) && samepng(g, file),
+        "stored PNG file reads back");
+    double  t = now();
+    bool    ok = pgsaveimage(g, file, PG_PNG);
+    timing("save 640x480 PNG", now() - t);
+    check(ok && samepng(g, file), "deflated PNG file reads back");
+
+    // Streamed straight to a PNG, in strips the deflate window spans.
+    Canvas      *whole = pgnewbmp(800, 600);
+    ImageWriter *w = pgopenimage(file, PG_PNG, 800, 600);
+    streamscene(whole, 0);
+    ok = pgstream(800, 600, 37, streamscene, pgimagesink, w);
+    check(pgcloseimage(w) && ok && samepng(whole, file),
+        "streamed PNG matches a whole-canvas render");
+
+    remove(file);
+    pgfree(g);
+    pgfree(whole);
+}
+
+
+/*
+
+    Shared canvases.
+
+*/
+
+
+static void sharedcanvases(void) {
+    Canvas      *g = pgnewshared(300, 200);
+    Canvas      *in = g? pgimportshared(pgsharedfd(g)): 0;
+    check(g && in && in->width == 300 && in->height == 200
+        && pggeneration(in) == 0,
+        "import maps the shared canvas");
+    if (!g || !in)
+        return;
+
+    Canvas      *ref = pgnewbmp(300, 200);
+    testpattern(g);
+    triangle(g, 1);
+    testpattern(ref);
+    triangle(ref, 1);
+    unsigned    generation = pgpublish(g);
+    check(generation == 1 && pggeneration(in) == generation
+        && samepixels(in, ref, 300, 200),
+        "import sees the published frame");
+
+    // The producer switches format between frames.
+    pgpixelformat(g, PG_PABGR);
+    pgclear(g, (Colour) { 0.2f, 0.4f, 0.6f, 0.8f });
+    pgpixelformat(ref, PG_PABGR);
+    pgclear(ref, (Colour) { 0.2f, 0.4f, 0.6f, 0.8f });
+    generation = pgpublish(g);
+    check(generation == 2 && pggeneration(in) == generation
+        && ((Bitmap*) in)->format == PG_PABGR
+        && samepixels(in, ref, 300, 200),
+        "import follows the producer's format");
+
+    pgfree(g);
+    check(samepixels(in, ref, 300, 200), "import outlives the producer");
+    pgfree(in);
+    pgfree(ref);
+}
+
+
+/*
+
+    Parallel drawing.
+
+*/
+
+
+static void parallel(void) {
+    Box     *grid = panelgrid(16, 16, 1600, 1200);
+    Canvas  *a = pgnewbmp(1600, 1200);
+    Canvas  *b = pgnewbmp(1600, 1200);
+
+    double  t = now();
+    pgdrawbox(a, grid);
+    timing("draw 16x16 panels on one thread", now() - t);
+
+    pgboxthreads(grid, 4);
+    dirty(grid);
+    t = now();
+    pgdrawbox(b, grid);
+    timing("draw 16x16 panels on 4 threads", now() - t);
+    check(samepixels(a, b, 1600, 1200), "parallel drawing matches sequential");
+
+    // Redraw one panel.
+    grid->children->next->children->clean = false;
+    pgdrawbox(b, grid);
+    pgboxthreads(grid, 1);
+
+    pgfree(a);
+    pgfree(b);
+}
+
+
+/*
+
+    Contexts.
+
+*/
+
+
+static void contexts(void) {
+    Context *outer = pgnewcontext();
+    Context *own = pgnewcontext();
+    Box     *root = pgsetcontext(pgbox(0), outer);
+    Box     *child = pgbox(0);
+    Box     *styled = pgsetcontext(pgbox(0), own);
+    Box     *leaf = pgbox(0);
+    pgaddbox(styled, leaf);
+    pgaddbox(child, styled);
+    pgaddbox(root, child);
+    check(pgboxcontext(child) == outer && pgboxcontext(styled) == own
+        && pgboxcontext(leaf) == own,
+        "added boxes keep their own context");
+
+    Box     *bare = pgbox(0);
+    pgaddbox(bare, pgbox(0));
+    pgaddbox(styled, bare);
+    check(pgboxcontext(bare) == own && pgboxcontext(bare->children) == own,
+        "added boxes inherit the nearest context");
+}
+
+
+/*
+
+    Hit testing.
+
+*/
+
+
+// pglocate() without the index.
+static Box *scan(Box *box, int x, int y) {
+    for (Box *i = box->children; i; i = i->next)
+        if (i->x <= x && i->y <= y &&
+            x <= i->x + i->width && y <= i->y + i->height)
+            return scan(i, x - i->x, y - i->y);
+    return box;
+}
+
+static void packchildren(Box *box) {
+    for (Box *i = box->children; i; i = i->next)
+        pgpack(i);
+}
+
+static void locate(const char *what, Box *box) {
+    char    label[64];
+    int     wrong = 0;
+    double  t;
+
+    srand(1);
+    for (int i = 0; i < 20000; i++) {
+        int     x = rand() % (box->width + 20) - 10;
+        int     y = rand() % (box->height + 20) - 10;
+        wrong += pglocate(box, x, y) != scan(box, x, y);
+    }
+    for (int i = 0; i <= box->width && i <= box->height; i++)
+        wrong += pglocate(box, i, i) != scan(box, i, i);
+    snprintf(label, sizeof label, "%s matches a linear scan", what);
+    check(!wrong, label);
+
+    t = now();
+    for (int i = 0; i < 20000; i++)
+        scan(box, rand() % box->width, rand() % box->height);
+    snprintf(label, sizeof label, "%s: 20000 scans", what);
+    timing(label, now() - t);
+
+    t = now();
+    for (int i = 0; i < 20000; i++)
+        pglocate(box, rand() % box->width, rand() % box->height);
+    snprintf(label, sizeof label, "%s: 20000 lookups", what);
+    timing(label, now() - t);
+}
+
+static void hittests(void) {
+    Box     *grid = panelgrid(100, 100, 1000, 1000);
+    locate("100x100 grid", grid);
+
+    Box     *row = pgstackbox(true);
+    for (int i = 0; i < 10000; i++)
+        pgaddbox(row, pgbox(0));
+    row->width = 20000;
+    row->height = 10;
+    pgpack(row);
+    locate("10000-wide row", row);
+
+    Box     *column = pgstackbox(false);
+    for (int i = 0; i < 10000; i++)
+        pgaddbox(column, pgbox(0));
+    column->width = 10;
+    column->height = 20000;
+    pgpack(column);
+    locate("10000-high column", column);
+
+    static BoxMethods   freemethods = { .pack = packchildren };
+    Box     *scatter = pgbox(&freemethods);
+    srand(1);
+    for (int i = 0; i < 5000; i++) {
+        Box     *child = pgbox(0);
+        child->x = rand() % 1000;
+        child->y = rand() % 1000;
+        child->width = rand() % 60;
+        child->height = rand() % 60;
+        pgaddbox(scatter, child);
+    }
+    scatter->width = 1000;
+    scatter->height = 1000;
+    pgpack(scatter);
+    locate("5000 scattered boxes", scatter);
+
+    // Moving a child must not leave a stale index behind.
+    Box     *moved = row->children->next;
+    pgmovebox(moved, 19990, 0, 10, 10);
+    check(pglocate(row, 19995, 5) == moved && pglocate(row, 3, 5) != moved,
+        "moved child is found at its new place");
+}
+
+
+/*
+
+    Incremental packing.
+
+*/
+
+
+static int  packs;
+static int  draws;
+
+static void countpack(Box *box) {
+    packs++;
+    pgbox_horizstack.pack(box);
+}
+
+static void countdraw(Box *box, Canvas *g) {
+    draws++;
+    pgclear(g, (Colour) {
+        box->x % 7 / 7.0f, box->y % 5 / 5.0f, box->width % 3 / 3.0f, 1 });
+}
+
+static void red(Box *box, Canvas *g) {
+    (void) box;
+    pgclear(g, (Colour) { 1, 0, 0, 1 });
+}
+
+// A header above 30 rows of 30 cells; each row starts with a fixed cell.
+static Box *cellgrid(int width, int height, int fixedwidth) {
+    static BoxMethods   rowmethods = { .pack = countpack };
+    static BoxMethods   cellmethods = { .draw = countdraw };
+    Box     *root = pgstackbox(false);
+    Box     *header = pgbox(&cellmethods);
+    header->fixed = true;
+    header->height = 40;
+    pgaddbox(root, header);
+    for (int r = 0; r < 30; r++) {
+        Box     *row = pgbox(&rowmethods);
+        for (int c = 0; c < 30; c++) {
+            Box     *cell = pgbox(&cellmethods);
+            if (c == 0) {
+                cell->fixed = true;
+                cell->width = r == 3? fixedwidth: 50;
+            }
+            pgaddbox(row, cell);
+        }
+        pgaddbox(root, row);
+    }
+    root->width = width;
+    root->height = height;
+    pgpack(root);
+    return root;
+}
+
+static void repack(const char *what, Box *root, Canvas *g, int wantpacks,
+    int wantdraws)
+{
+    char    label[64];
+    packs = 0;
+    draws = 0;
+    pgpack(root);
+    pgdrawbox(g, root);
+    snprintf(label, sizeof label, "%s: %d packs, %d draws", what, packs,
+        draws);
+    check(packs == wantpacks && draws == wantdraws, label);
+}
+
+static void incremental(void) {
+    Canvas  *a = pgnewbmp(1000, 1000);
+    Canvas  *b = pgnewbmp(1000, 1000);
+    Box     *root = cellgrid(800, 640, 50);
+    pgdrawbox(a, root);
+
+    repack("same size", root, a, 0, 0);
+    root->height = 700;
+    pgpack(root);
+    pgdrawbox(a, root);
+    root->height = 701;
+    repack("one pixel taller", root, a, 0, 0);
+
+    Box     *cell = root->children->next->next->next->next->children;
+    cell->width = 80;
+    pgrelayout(cell);
+    repack("wider fixed cell", root, a, 1, 30);
+
+    pgdrawbox(b, cellgrid(800, 701, 80));
+    check(samepixels(a, b, 1000, 1000),
+        "incremental drawing matches a fresh one");
+
+    // A box moved by hand carries its children once it is placed.
+    static BoxMethods   plainmethods;
+    static BoxMethods   redmethods = { .draw = red };
+    Box     *frame = pgbox(&plainmethods);
+    Box     *mid = pgbox(&plainmethods);
+    Box     *leaf = pgbox(&redmethods);
+    frame->width = frame->height = 100;
+    mid->x = mid->y = 10;
+    mid->width = mid->height = 50;
+    leaf->x = leaf->y = 5;
+    leaf->width = leaf->height = 10;
+    pgaddbox(mid, leaf);
+    pgaddbox(frame, mid);
+    pgpack(frame);
+    mid->x = 40;
+    mid->y = 30;
+    pgplacebox(mid);
+    pgclear(a, (Colour) { 1, 1, 1, 1 });
+    pgdrawbox(a, frame);
+    Bitmap  *bmp = (Bitmap*) a;
+    check(leaf->absx == 45 && leaf->absy == 35
+        && bmp->pixels[40 * bmp->stride + 50] == 0xffff0000
+        && bmp->pixels[20 * bmp->stride + 20] == 0xffffffff,
+        "placed box draws its children at the new place");
+
+    pgfree(a);
+    pgfree(b);
+}
+
+
+int main(void) {
+    fonts();
+    gradients();
+    blits();
+    linearlight();
+    layers();
+    boxtrees();
+    compiled();
+    transforms();
+    scanlines();
+    solidspans();
+    fillrules();
+    masks();
+    formats();
+    streams();
+    imagefiles();
+    sharedcanvases();
+    parallel();
+    contexts();
+    hittests();
+    incremental();
+    return failures != 0;
+}
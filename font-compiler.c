@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include <pg.h>
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s font.ttf output.pgf\n", argv[0]);
+        return 1;
+    }
+
+    Font *font = pgfontfile(argv[1], 0);
+    if (!font) {
+        fprintf(stderr, "%s: cannot load font\n", argv[1]);
+        return 1;
+    }
+
+    if (!pgsavefont(font, argv[2])) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    pgfreefont(font);
+    return 0;
+}
@@ -3,9 +3,10 @@
 #include <string.h>
 #include <SDL2/SDL.h>
 #include <pg.h>
+#include <pgsdl.h>
 
 SDL_Window  *rootw;
-Canvas      *rootg;
+Scheduler   *scheduler;
 
 Box         *root;
 Box         *mat;
@@ -94,7 +95,7 @@ void drawmat(Box *box, Canvas *g) {
 Box *textbox(void (*changed)(Box *box, const char *text), const char *text) {
     Box *box = pgtextbox(pgtextboxdata(text));
     box->fixed = true;
-    box->height = pgmeasure(pgthemefont(), "M").y * 2;
+    box->height = pgmeasure(pgboxcontext(box)->font, "M").y * 2;
     pgoverridebox(box, (BoxMethods) { .chars = changed });
     return box;
 }
@@ -145,40 +146,18 @@ void init() {
 
 }
 
-void updatewindow() {
-    SDL_Surface *screen = SDL_GetWindowSurface(rootw);
-    SDL_LockSurface(screen);
-    memmove(
-        screen->pixels,
-        ((Bitmap*) rootg)->pixels,
-        screen->pitch * screen->h);
-    SDL_UnlockSurface(screen);
-    SDL_UpdateWindowSurface(rootw);
-}
-
-void update() {
-    pgdrawbox(rootg, root);
-    updatewindow();
-}
-
 void resized(SDL_Window *rootw) {
     int     width;
     int     height;
 
     SDL_GetWindowSize(rootw, &width, &height);
-    root->width = width;
-    root->height = height;
-
-    // Re-create root canvas.
-    pgfree(rootg);
-    rootg = pgnewbmp(width, height);
-    pgpack(root);
-    fflush(stdout);
-    pgdrawbox(rootg, root);
-    updatewindow();
+    if (width != root->width || height != root->height) {
+        root->width = width;
+        root->height = height;
+        pgpack(root);
+    }
 }
 
-
 unsigned sdlmod(unsigned sdl) {
     return
         + (sdl & KMOD_LCTRL? 0x01: 0)
@@ -191,7 +170,51 @@ unsigned sdlmod(unsigned sdl) {
         + (sdl & KMOD_RGUI? 0x80: 0);
 }
 
+void handle(SDL_Event *e) {
+    if (pgsdlframe(scheduler, e))
+        return;
+
+    switch (e->type) {
+    case SDL_QUIT:
+        exit(0);
+
+    case SDL_WINDOWEVENT:
+        switch (e->window.event) {
+
+        case SDL_WINDOWEVENT_SIZE_CHANGED:
+            resized(rootw);
+            break;
+
+        case SDL_WINDOWEVENT_EXPOSED:
+            pgsdlexpose(scheduler);
+            break;
+        }
+        break;
+
+    case SDL_MOUSEBUTTONUP:
+        pgboxclicked(
+            pglocate(root, e->button.x, e->button.y),
+            e->button.x,
+            e->button.y);
+        break;
+
+    case SDL_KEYDOWN:
+        pgboxkey(
+            pgfocused(root)? pgfocused(root): root,
+            e->key.keysym.scancode,
+            sdlmod(e->key.keysym.mod));
+        break;
+
+    case SDL_TEXTINPUT:
+        pgboxchars(pgfocused(root)? pgfocused(root): root, e->text.text);
+        break;
+    }
+}
+
 int main(void) {
+    // Page in the theme font while SDL starts up.
+    pgwarmfont(pgboxcontext(0)->font, "abcdefghijklmnopqrstuvwxyz"
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 .,:;!?-~()", false);
     init();
 
     SDL_Init(SDL_INIT_VIDEO);
@@ -203,41 +226,19 @@ int main(void) {
             1000,
             1000,
             SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
-
-    for (SDL_Event e; SDL_WaitEvent(&e); )
-        switch (e.type) {
-        case SDL_QUIT:
-            return 0;
-
-        case SDL_WINDOWEVENT:
-            switch (e.window.event) {
-
-            case SDL_WINDOWEVENT_SIZE_CHANGED:
-            case SDL_WINDOWEVENT_EXPOSED:
-                resized(rootw);
-                break;
-            }
-            break;
-
-        case SDL_MOUSEBUTTONUP:
-            pgboxclicked(
-                pglocate(root, e.button.x, e.button.y),
-                e.button.x,
-                e.button.y);
-            update();
-            break;
-
-        case SDL_KEYDOWN:
-            pgboxkey(
-                pggetfocus()? pggetfocus(): root,
-                e.key.keysym.scancode,
-                sdlmod(e.key.keysym.mod));
-            update();
-            break;
-
-        case SDL_TEXTINPUT:
-            pgboxchars(pggetfocus()? pggetfocus(): root, e.text.text);
-            update();
-            break;
-        }
+    scheduler = pgsdlscheduler(rootw, root);
+    pgsdllock(scheduler);
+    resized(rootw);
+    pgsdlunlock(scheduler);
+    pgsdlrequest(scheduler);
+
+    // Handle everything queued, then ask for one frame.
+    for (SDL_Event e; SDL_WaitEvent(&e); ) {
+        pgsdllock(scheduler);
+        do
+            handle(&e);
+        while (SDL_PollEvent(&e));
+        pgsdlunlock(scheduler);
+        pgsdlrequest(scheduler);
+    }
 }
@@ -1,5 +1,11 @@
+#define _GNU_SOURCE
+
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,27 +19,77 @@
 #include <pg.h>
 
 #define FLATNESS 1.00f
+#define TOLERANCE 0.05f
+#define SCANLINE_AREA (256 * 256)
+#define MARK_RUN 32
 #define BEZ_LIMIT 7
+#define LAYER_POOL 8
+#define DRAW_DEQUE 256
+#define INDEX_MIN 16        // Children before pglocate() uses an index.
+#define INDEX_GRID 64
+#define ZWINDOW 32768
+#define ZBUFFER (ZWINDOW * 3)
+#define ZHASH_BITS 15
+#define IDAT_SIZE 65536
+#define SHARED_MAGIC "pgshm1"
+#define SHARED_HEADER 64    // Keeps shared pixels cache-line aligned.
+#define SDF_EM 64
+#define SDF_SPREAD 8.0f
+#define SDF_BEZ_LIMIT 4
 
 #define new(t,...) memcpy(malloc(sizeof(t)), &(t) { __VA_ARGS__ }, sizeof(t))
 
+typedef float   v4f __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+typedef uint32_t v4u __attribute__((vector_size(16)));
+typedef uint8_t v16b __attribute__((vector_size(16)));
+
 typedef struct {
     float       *buf;
     int         stride;
+    uint8_t     *marks;     // Runs of MARK_RUN columns holding coverage.
+    int         top;        // First row held in buf and marks.
+    bool        aliased;
+    int         fillrule;
     Rect        clip;
     Rect        dirty;
     CTM         ctm;
     Point       *tmp;
 } BitmapBuf;
 
-static Font     *themefont;
-static float    themefontsz = 14.0f * 96 / 72;
-static Colour   themebg = {1, 1, 1, 1};
-static Colour   themebg2 = {.9, .9, .9, 1};
-static Colour   themefg = {.2, .2, .2, 1};
-static Colour   themeaccent = {1, .2, .5, 1};
+typedef struct {
+    Point       *pts;
+    Point       *edges;
+    int         ptscap;
+    int         edgecap;
+} EdgeList;
+
+typedef struct {
+    char        magic[8];
+    int32_t     width;
+    int32_t     height;
+    int32_t     stride;
+    int32_t     format;
+    _Atomic uint32_t generation;
+} SharedHeader;
+
+struct SharedFrame {
+    SharedHeader *header;   // Start of the mapping.
+    size_t      size;
+    int         fd;
+};
+
+static const Context themedefaults = {
+    .fontsz = 14.0f * 96 / 72,
+    .fg = {.2, .2, .2, 1},
+    .bg = {1, 1, 1, 1},
+    .bg2 = {.9, .9, .9, 1},
+    .accent = {1, .2, .5, 1},
+};
 
-static Box      *focus;
+// Used by boxes that have not been given a context.
+static Context          defaultcontext;
+static pthread_once_t   defaultonce = PTHREAD_ONCE_INIT;
 
 
 /*
@@ -53,7 +109,7 @@ static inline Colour blend(Colour bg, Colour fg, float a) {
     float   r = fg.r * a + bg.r * na;
     float   g = fg.g * a + bg.g * na;
     float   b = fg.b * a + bg.b * na;
-    return rgba(r, g, b, a);
+    return rgba(r, g, b, a + bg.a * na);
 }
 
 static inline float clamp(float a, float b, float c) {
@@ -64,6 +120,108 @@ static inline uint32_t blendinto(uint32_t bg, Colour fg, float a) {
     return packrgb(blend(unpackrgb(bg), fg, a));
 }
 
+// Source-over of a premultiplied colour with coverage a.
+static inline uint32_t blendover(uint32_t bg, Colour fg, float a) {
+    if (a == 0)
+        return bg;
+
+    Colour  b = unpackrgb(bg);
+    float   na = 1 - fg.a * a;
+    return packrgb(rgba(
+        fg.r * a + b.r * na,
+        fg.g * a + b.g * na,
+        fg.b * a + b.b * na,
+        fg.a * a + b.a * na));
+}
+
+static inline v4f vmin(v4f a, v4f b) {
+    v4i     m = a < b;
+    return (v4f) (((v4i) a & m) | ((v4i) b & ~m));
+}
+
+static inline v4f vmax(v4f a, v4f b) {
+    v4i     m = a > b;
+    return (v4f) (((v4i) a & m) | ((v4i) b & ~m));
+}
+
+static inline v4f vfloor(v4f a) {
+    v4i     i = __builtin_convertvector(a, v4i);
+    v4f     f = __builtin_convertvector(i, v4f);
+    return f + (v4f) ((v4i) (v4f) { -1, -1, -1, -1 } & (f > a));
+}
+
+static inline v4f vabs(v4f a) {
+    return (v4f) ((v4i) a & 0x7fffffff);
+}
+
+// Gamma tables: sRGB to 12-bit linear light and back.
+static uint16_t tolinear[256];
+static uint8_t  tosrgb[4096];
+static pthread_once_t gammaonce = PTHREAD_ONCE_INIT;
+
+static void initgamma(void) {
+    for (int i = 0; i < 256; i++) {
+        float   c = i / 255.0f;
+        float   l = c <= 0.04045f? c / 12.92f: powf((c + 0.055f) / 1.055f, 2.4f);
+        tolinear[i] = roundf(l * 4095);
+    }
+    for (int i = 0; i < 4096; i++) {
+        float   l = i / 4095.0f;
+        float   c = l <= 0.0031308f? l * 12.92f: 1.055f * powf(l, 1 / 2.4f) - 0.055f;
+        tosrgb[i] = roundf(c * 255);
+    }
+}
+
+// As blendinto() but interpolating in linear light.
+static inline uint32_t blendlinear(uint32_t bg, uint32_t fg, float a) {
+    if (a >= 1)
+        return fg;
+    if (a <= 0)
+        return bg;
+
+    unsigned    w = a * 256 + 0.5f;
+    unsigned    nw = 256 - w;
+    unsigned    r = tolinear[bg >> 16 & 255] * nw + tolinear[fg >> 16 & 255] * w;
+    unsigned    g = tolinear[bg >> 8 & 255] * nw + tolinear[fg >> 8 & 255] * w;
+    unsigned    b = tolinear[bg & 255] * nw + tolinear[fg & 255] * w;
+    unsigned    alpha = (255 * w + (bg >> 24) * nw) >> 8;
+    return  (alpha << 24) +
+            (tosrgb[r >> 8] << 16) +
+            (tosrgb[g >> 8] << 8) +
+            tosrgb[b >> 8];
+}
+
+// Straight linear light of a channel of a premultiplied pixel.
+static inline float lightof(uint32_t px, int shift, unsigned alpha) {
+    unsigned    c = px >> shift & 255;
+    if (alpha < 255)
+        c = alpha? fminf(255, (c * 255 + alpha / 2) / alpha): 0;
+    return tolinear[c] * (1 / 4095.0f);
+}
+
+// As blendlinear() for premultiplied pixels, compositing source-over.
+static inline uint32_t blendlinearover(uint32_t bg, uint32_t fg, float a) {
+    if (a <= 0)
+        return bg;
+
+    unsigned    fa = fg >> 24;
+    unsigned    ba = bg >> 24;
+    float       sa = fa * (1 / 255.0f) * fminf(a, 1);
+    if (sa >= 1)
+        return fg;
+
+    float       da = ba * (1 / 255.0f) * (1 - sa);
+    float       oa = sa + da;
+    uint32_t    out = (uint32_t) (oa * 255 + 0.5f) << 24;
+    for (int shift = 0; oa > 0 && shift < 24; shift += 8) {
+        float   l = (lightof(fg, shift, fa) * sa + lightof(bg, shift, ba) * da)
+                    / oa;
+        out |= (uint32_t) (tosrgb[(int) (fminf(l, 1) * 4095 + 0.5f)] * oa
+                    + 0.5f) << shift;
+    }
+    return out;
+}
+
 static inline Point midpoint(Point a, Point b) {
     return pt((a.x + b.x) * 0.5f, (a.y + b.y) * 0.5f);
 }
@@ -135,12 +293,79 @@ Canvas *pgsubcanvas(Canvas *g, int ax, int ay, int bx, int by) {
 
 void *pgfree(Canvas *g) {
     if (g) {
+        while (g->depth)
+            pgrestore(g);
         g->_->free(g);
         free(g);
     }
     return 0;
 }
 
+static CanvasState savedstate(Canvas *g) {
+    return (CanvasState) {
+        g->width,
+        g->height,
+        g->clip,
+        g->ctm,
+        g->ox,
+        g->oy,
+    };
+}
+
+static void loadstate(Canvas *g, CanvasState s) {
+    g->_->origin(g, s.ox - g->ox, s.oy - g->oy);
+    g->width = s.width;
+    g->height = s.height;
+    g->clip = s.clip;
+    g->ox = s.ox;
+    g->oy = s.oy;
+    pgctm(g, s.ctm);
+}
+
+Canvas *pgsave(Canvas *g) {
+    if (g && g->depth < PG_STATE_DEPTH) {
+        g->saved[g->depth++] = savedstate(g);
+        return g;
+    }
+    return 0;
+}
+
+Canvas *pgrestore(Canvas *g) {
+    if (g && g->depth > 0)
+        loadstate(g, g->saved[--g->depth]);
+    return g;
+}
+
+// Move the origin to (ax, ay) and limit drawing to the given size.
+Canvas *pgorigin(Canvas *g, int ax, int ay, int width, int height) {
+    if (g) {
+        g->_->origin(g, ax, ay);
+        g->ox += ax;
+        g->oy += ay;
+        g->width = width;
+        g->height = height;
+        g->clip = (Rect) {{
+            clamp(0, g->clip.ax - ax, width),
+            clamp(0, g->clip.ay - ay, height),
+            clamp(0, g->clip.bx - ax, width),
+            clamp(0, g->clip.by - ay, height),
+        }};
+    }
+    return g;
+}
+
+// Intersect the clip with r, in device co-ordinates.
+Canvas *pgclip(Canvas *g, Rect r) {
+    if (g)
+        g->clip = (Rect) {{
+            clamp(g->clip.ax, r.ax, g->clip.bx),
+            clamp(g->clip.ay, r.ay, g->clip.by),
+            clamp(g->clip.ax, r.bx, g->clip.bx),
+            clamp(g->clip.ay, r.by, g->clip.by),
+        }};
+    return g;
+}
+
 Canvas* pgclean(Canvas *g) {
     if (g)
         g->_->clean(g);
@@ -191,6 +416,33 @@ Canvas* pgfill(Canvas *g, Colour colour) {
     return g;
 }
 
+Canvas* pgfillpaint(Canvas *g, const Paint *paint) {
+    if (g && paint) {
+        g->_->fillpaint(g, paint);
+        pgclean(g);
+    }
+    return g;
+}
+
+Canvas* pgblit(
+    Canvas      *g,
+    Canvas      *src,
+    IntRect     srcrect,
+    IntRect     dstrect,
+    int         filter)
+{
+    if (g && src)
+        g->_->blit(g, src, srcrect, dstrect, filter);
+    return g;
+}
+
+// Fill colour through an A8 mask whose top-left is at device (x, y).
+Canvas* pgfillmask(Canvas *g, Canvas *mask, int x, int y, Colour colour) {
+    if (g && mask)
+        g->_->fillmask(g, mask, x, y, colour);
+    return g;
+}
+
 Canvas* pgstroke(Canvas *g, float stroke, Colour colour) {
     if (g) {
         g->_->stroke(g, stroke, colour);
@@ -238,6 +490,34 @@ Canvas* pgstrokerect(Canvas *g, float stroke, Colour colour, Rect r) {
     return g;
 }
 
+// Choose how fills are rasterized; PG_AUTO decides per path.
+Canvas *pgrasterizer(Canvas *g, int rasterizer) {
+    if (g)
+        g->rasterizer = rasterizer;
+    return g;
+}
+
+// Aliased fills cover whole pixels whose centres are inside the path.
+Canvas *pgantialias(Canvas *g, bool antialias) {
+    if (g)
+        g->aliased = !antialias;
+    return g;
+}
+
+Canvas *pgfillrule(Canvas *g, int fillrule) {
+    if (g)
+        g->fillrule = fillrule;
+    return g;
+}
+
+Canvas *pggamma(Canvas *g, bool linear) {
+    if (g) {
+        pthread_once(&gammaonce, initgamma);
+        g->linear = linear;
+    }
+    return g;
+}
+
 Canvas* pgctm(Canvas *g, CTM ctm) {
     if (g) {
         g->_->setctm(g, ctm);
@@ -339,6 +619,15 @@ Path *pgpclose(Path *path) {
     return path;
 }
 
+void *pgfreepath(Path *path) {
+    if (path) {
+        free(path->shapes);
+        free(path->pts);
+        free(path);
+    }
+    return 0;
+}
+
 Path *pgpclean(Path *path) {
     if (path) {
         path->np = 0;
@@ -348,6 +637,383 @@ Path *pgpclean(Path *path) {
 }
 
 
+/*
+
+    Compiled Paths.
+
+*/
+
+
+static int buildedges(EdgeList *e, Path *path, CTM ctm, Rect clip);
+
+static Path *copypath(Path *dst, Path *src) {
+    pgpclean(dst);
+    if (dst->capacity < src->np + 1) {
+        dst->capacity = src->np + 1;
+        dst->shapes = realloc(dst->shapes, dst->capacity);
+        dst->pts = realloc(dst->pts, dst->capacity * sizeof *dst->pts);
+    }
+    memcpy(dst->shapes, src->shapes, src->np);
+    memcpy(dst->pts, src->pts, src->np * sizeof *src->pts);
+    dst->np = src->np;
+    dst->homeindex = src->homeindex;
+    dst->open = src->open;
+    return dst;
+}
+
+// Flatten and transform path into cp; path is copied. The edges are not
+// clipped: a compiled path is filled under any later translation, so an
+// edge outside today's clip may be inside tomorrow's. Each fill clips the
+// translated edges to the canvas as it places them, as for any path.
+CompiledPath *pgcompilepath(CompiledPath *cp, Path *path, CTM ctm) {
+    if (!path)
+        return cp;
+    if (!cp)
+        cp = new(CompiledPath, .path = pgpath(0));
+    if (cp->path != path)
+        copypath(cp->path, path);
+
+    EdgeList    e = { 0, cp->edges, 0, cp->nedges * 2 };
+    Rect        all = {{ -INFINITY, -INFINITY, INFINITY, INFINITY }};
+    cp->nedges = buildedges(&e, cp->path, ctm, all);
+    cp->edges = e.edges;
+    cp->ctm = ctm;
+    free(e.pts);
+    return cp;
+}
+
+void *pgfreecompiled(CompiledPath *cp) {
+    if (cp) {
+        free(cp->edges);
+        pgfreepath(cp->path);
+        free(cp);
+    }
+    return 0;
+}
+
+Canvas *pgfillcompiled(Canvas *g, CompiledPath *cp, Colour colour) {
+    Paint   solid = { .colour = colour };
+    return pgpaintcompiled(g, cp, &solid);
+}
+
+Canvas *pgpaintcompiled(Canvas *g, CompiledPath *cp, const Paint *paint) {
+    if (g && cp && paint)
+        g->_->fillcompiled(g, cp, paint);
+    return g;
+}
+
+
+/*
+
+    Paints.
+
+*/
+
+
+static const CanvasMethods bitmapmethods;
+
+static void buildlut(Paint *paint) {
+    ColourStop  *stops = paint->stops;
+    int         n = paint->nstops;
+
+    for (int i = 0, j = 0; i < 256; i++) {
+        float   t = i / 255.0f;
+        while (j < n && stops[j].at < t)
+            j++;
+
+        Colour  c;
+        if (n == 0)
+            c = rgba(0, 0, 0, 0);
+        else if (j == 0)
+            c = stops[0].colour;
+        else if (j == n)
+            c = stops[n - 1].colour;
+        else {
+            Colour  a = stops[j - 1].colour;
+            Colour  b = stops[j].colour;
+            float   span = stops[j].at - stops[j - 1].at;
+            float   k = span? (t - stops[j - 1].at) / span: 1;
+            c = rgba(
+                a.r + (b.r - a.r) * k,
+                a.g + (b.g - a.g) * k,
+                a.b + (b.b - a.b) * k,
+                a.a + (b.a - a.a) * k);
+        }
+        paint->lut[i] = packrgb(c);
+    }
+}
+
+Paint *pglinear(Point a, Point b, int spread) {
+    Paint   *paint = new(Paint,
+                .type = 1,
+                .spread = spread,
+                .a = a,
+                .b = b);
+    buildlut(paint);
+    return paint;
+}
+
+Paint *pgradial(Point centre, float radius, int spread) {
+    Paint   *paint = new(Paint,
+                .type = 2,
+                .spread = spread,
+                .a = centre,
+                .radius = radius);
+    buildlut(paint);
+    return paint;
+}
+
+Paint *pgpattern(Canvas *image, CTM ctm, int spread, int filter) {
+    if (!image || image->_ != &bitmapmethods)
+        return 0;
+    return new(Paint,
+            .type = 3,
+            .spread = spread,
+            .image = (Bitmap*) image,
+            .ctm = ctm,
+            .filter = filter);
+}
+
+Paint *pgaddstop(Paint *paint, float at, Colour colour) {
+    if (paint) {
+        at = clamp(0, at, 1);
+        paint->stops = realloc(paint->stops,
+                        (paint->nstops + 1) * sizeof *paint->stops);
+
+        // Keep stops ordered; equal positions keep insertion order.
+        int     i = paint->nstops++;
+        for ( ; i > 0 && paint->stops[i - 1].at > at; i--)
+            paint->stops[i] = paint->stops[i - 1];
+        paint->stops[i] = (ColourStop) { at, colour };
+        buildlut(paint);
+    }
+    return paint;
+}
+
+void *pgfreepaint(Paint *paint) {
+    if (paint) {
+        free(paint->stops);
+        free(paint);
+    }
+    return 0;
+}
+
+static inline v4f spread(v4f t, int mode) {
+    v4f     zero = { 0, 0, 0, 0 };
+    v4f     one = { 1, 1, 1, 1 };
+    v4f     two = { 2, 2, 2, 2 };
+
+    switch (mode) {
+    case PG_REPEAT:
+        return t - vfloor(t);
+    case PG_REFLECT:
+        t = t - two * vfloor(t * 0.5f);
+        return one - vabs(t - one);
+    default:
+        return vmax(zero, vmin(t, one));
+    }
+}
+
+static inline void lookup(uint32_t * restrict out, const uint32_t *lut, v4f t) {
+    v4f     zero = { 0, 0, 0, 0 };
+    v4f     one = { 1, 1, 1, 1 };
+    t = vmax(zero, vmin(t, one));   // Also guards against overflow and NaN.
+
+    v4i     i = __builtin_convertvector(t * 255.0f + 0.5f, v4i);
+    out[0] = lut[i[0]];
+    out[1] = lut[i[1]];
+    out[2] = lut[i[2]];
+    out[3] = lut[i[3]];
+}
+
+// Wrap texel indices into 0..n-1.
+static inline v4i wrap(v4i i, int n, int mode) {
+    v4i     zero = { 0, 0, 0, 0 };
+    v4i     m;
+
+    switch (mode) {
+    case PG_REPEAT:
+        i %= n;
+        return i + (n & (i < zero));
+    case PG_REFLECT:
+        i %= n * 2;
+        i += (n * 2) & (i < zero);
+        m = i >= n;
+        return (i & ~m) | ((n * 2 - 1 - i) & m);
+    default:
+        i = (i & (i > zero));
+        m = i < n;
+        return (i & m) | ((n - 1) & ~m);
+    }
+}
+
+// Pixels of row y; a streamed strip holds rows from bmp->top.
+static inline uint32_t *bmprow(const Bitmap *bmp, int y) {
+    return bmp->pixels + (ptrdiff_t) (y - bmp->top) * bmp->stride;
+}
+
+static inline v4u gather(const Bitmap *image, v4i x, v4i y) {
+    const uint32_t  *p = image->pixels;
+    v4i             at = (y - image->top) * image->stride + x;
+    return (v4u) { p[at[0]], p[at[1]], p[at[2]], p[at[3]] };
+}
+
+// Interpolate packed pixels by w/256, two channels at a time.
+static inline v4u lerppx(v4u a, v4u b, v4u w) {
+    v4u     m = { 0x00ff00ff, 0x00ff00ff, 0x00ff00ff, 0x00ff00ff };
+    v4u     nw = 256 - w;
+    v4u     rb = ((a & m) * nw + (b & m) * w) >> 8 & m;
+    v4u     ag = ((a >> 8 & m) * nw + (b >> 8 & m) * w) & ~m;
+    return rb | ag;
+}
+
+// Scale packed pixels by w/256, two channels at a time.
+static inline v4u scalepx(v4u a, v4u w) {
+    v4u     m = { 0x00ff00ff, 0x00ff00ff, 0x00ff00ff, 0x00ff00ff };
+    return ((a & m) * w >> 8 & m) | ((a >> 8 & m) * w & ~m);
+}
+
+// Pixel formats: bit 0 swaps red and blue, bit 1 premultiplies by alpha.
+static inline v4u swaprb(v4u px) {
+    return (px & 0xff00ff00) | (px >> 16 & 0xff) | (px & 0xff) << 16;
+}
+
+static inline v4u premultiply(v4u px) {
+    v4u     a = px >> 24;
+    return (scalepx(px, a + (a >> 7)) & 0x00ffffff) | (px & 0xff000000);
+}
+
+static inline v4u unpremultiply(v4u px) {
+    v4u     a = px >> 24;
+    v4f     k = 255.0f / __builtin_convertvector(a | ((v4u) (a == 0) & 1), v4f);
+    v4f     max = { 255, 255, 255, 255 };
+    v4f     r = __builtin_convertvector(px >> 16 & 255, v4f) * k + 0.5f;
+    v4f     g = __builtin_convertvector(px >> 8 & 255, v4f) * k + 0.5f;
+    v4f     b = __builtin_convertvector(px & 255, v4f) * k + 0.5f;
+    return  (px & 0xff000000) |
+            __builtin_convertvector(vmin(r, max), v4u) << 16 |
+            __builtin_convertvector(vmin(g, max), v4u) << 8 |
+            __builtin_convertvector(vmin(b, max), v4u);
+}
+
+static inline v4u convertpx(v4u px, int from, int to) {
+    if (from & ~to & 2)
+        px = unpremultiply(px);
+    if ((from ^ to) & 1)
+        px = swaprb(px);
+    if (to & ~from & 2)
+        px = premultiply(px);
+    return px;
+}
+
+// Sample four texels at image co-ordinates; texel centres are integers.
+static inline void sample(
+    uint32_t * restrict out,
+    const Bitmap *image,
+    v4f         u,
+    v4f         v,
+    int         mode,
+    int         filter)
+{
+    int     w = image->g.width;
+    int     h = image->g.height;
+    v4u     px;
+
+    if (filter == PG_BILINEAR) {
+        v4f     fu = vfloor(u);
+        v4f     fv = vfloor(v);
+        v4i     x0 = __builtin_convertvector(fu, v4i);
+        v4i     y0 = __builtin_convertvector(fv, v4i);
+        v4u     wx = __builtin_convertvector((u - fu) * 256.0f, v4u);
+        v4u     wy = __builtin_convertvector((v - fv) * 256.0f, v4u);
+        v4i     x1 = wrap(x0 + 1, w, mode);
+        v4i     y1 = wrap(y0 + 1, h, mode);
+        x0 = wrap(x0, w, mode);
+        y0 = wrap(y0, h, mode);
+
+        v4u     top = lerppx(gather(image, x0, y0), gather(image, x1, y0), wx);
+        v4u     bot = lerppx(gather(image, x0, y1), gather(image, x1, y1), wx);
+        px = lerppx(top, bot, wy);
+    }
+    else {
+        v4i     x = __builtin_convertvector(vfloor(u + 0.5f), v4i);
+        v4i     y = __builtin_convertvector(vfloor(v + 0.5f), v4i);
+        px = gather(image, wrap(x, w, mode), wrap(y, h, mode));
+    }
+    px = convertpx(px, image->format, PG_ARGB);
+    memcpy(out, &px, sizeof px);
+}
+
+// Shade n pixels from (x, y) in device space. Writes up to 3 extra pixels.
+static void shade(
+    const Paint *paint,
+    CTM         inv,
+    int         x,
+    int         y,
+    int         n,
+    uint32_t * restrict out)
+{
+    v4f     lane = { 0, 1, 2, 3 };
+
+    // Position of each lane in user space and its step per 4 pixels.
+    v4f     ux = inv.a * ((float) x + lane) + (inv.c * y + inv.e);
+    v4f     uy = inv.b * ((float) x + lane) + (inv.d * y + inv.f);
+    float   sx = inv.a * 4;
+    float   sy = inv.b * 4;
+
+    if (paint->type == 1) {                 // Linear.
+        float   dx = paint->b.x - paint->a.x;
+        float   dy = paint->b.y - paint->a.y;
+        float   len = dx * dx + dy * dy;
+        float   kx = len? dx / len: 0;
+        float   ky = len? dy / len: 0;
+        v4f     t = (ux - paint->a.x) * kx + (uy - paint->a.y) * ky;
+        float   step = sx * kx + sy * ky;
+
+        for (int i = 0; i < n; i += 4) {
+            lookup(out + i, paint->lut, spread(t, paint->spread));
+            t += step;
+        }
+    }
+    else if (paint->type == 3) {            // Image.
+        CTM     m = pginvertctm(paint->ctm);
+        v4f     u = m.a * ux + m.c * uy + m.e;
+        v4f     v = m.b * ux + m.d * uy + m.f;
+        float   su = m.a * sx + m.c * sy;
+        float   sv = m.b * sx + m.d * sy;
+
+        if (paint->image->g.width && paint->image->g.height)
+            for (int i = 0; i < n; i += 4) {
+                sample(out + i, paint->image, u, v, paint->spread,
+                    paint->filter);
+                u += su;
+                v += sv;
+            }
+        else
+            memset(out, 0, n * sizeof *out);
+    }
+    else if (paint->type == 2) {            // Radial.
+        float   k = paint->radius? 1 / paint->radius: 0;
+        v4f     dx = (ux - paint->a.x) * k;
+        v4f     dy = (uy - paint->a.y) * k;
+
+        for (int i = 0; i < n; i += 4) {
+            v4f     t = dx * dx + dy * dy;
+            for (int j = 0; j < 4; j++)
+                t[j] = sqrtf(t[j]);
+            lookup(out + i, paint->lut, spread(t, paint->spread));
+            dx += sx * k;
+            dy += sy * k;
+        }
+    }
+    else {                                  // Solid.
+        uint32_t    c = packrgb(paint->colour);
+        for (int i = 0; i < n; i++)
+            out[i] = c;
+    }
+}
+
+
 /*
 
     Bitmap Canvas.
@@ -356,12 +1022,15 @@ Path *pgpclean(Path *path) {
 
 
 static const CanvasMethods bitmapmethods;
+static const CanvasMethods maskmethods;
+
+static void freeshared(SharedFrame *shared);
 
 static Canvas *
 bmp_new(uint32_t *pixels, int stride, int width, int height) {
     bool    ownpixels = pixels == 0;
     if (ownpixels)
-        pixels = calloc(stride * height, sizeof *pixels);
+        pixels = calloc((size_t) stride * height, sizeof *pixels);
     if (!pixels)
         return 0;
 
@@ -373,11 +1042,23 @@ bmp_new(uint32_t *pixels, int stride, int width, int height) {
 
             {{ 0, 0, width, height }},
             { 1, 0, 0, 1, 0, 0 },
+            false,
+            PG_AUTO,
+            false,
+            PG_NONZERO,
+            0,
+            0,
+            0,
+            {{ 0 }},
         },
         stride,
         pixels,
+        PG_ARGB,
         ownpixels,
         pgpath(0),
+        0,
+        0,
+        0,
     );
 }
 
@@ -397,9 +1078,27 @@ bmp_subcanvas(Canvas *parent, int ax, int ay, int width, int height) {
     if (!valid)
         return 0;
 
+    // Point at a row the parent holds, even if the sub-canvas starts
+    // outside a streamed strip.
     Bitmap      *bmp = (Bitmap*) parent;
-    uint32_t    *pixels = bmp->pixels + ay * bmp->stride + ax;
-    return bmp_new(pixels, bmp->stride, width, height);
+    int         row = clamp(bmp->top, ay,
+                    fmaxf(bmp->top, ceilf(parent->clip.by) - 1));
+    Canvas      *g = bmp_new(bmprow(bmp, row) + ax, bmp->stride, width, height);
+    if (g) {
+        ((Bitmap*) g)->format = bmp->format;
+        ((Bitmap*) g)->top = row - ay;
+        g->clip = (Rect) {{
+            clamp(0, parent->clip.ax - ax, width),
+            clamp(0, parent->clip.ay - ay, height),
+            clamp(0, parent->clip.bx - ax, width),
+            clamp(0, parent->clip.by - ay, height),
+        }};
+        g->linear = parent->linear;
+        g->rasterizer = parent->rasterizer;
+        g->aliased = parent->aliased;
+        g->fillrule = parent->fillrule;
+    }
+    return g;
 }
 
 Canvas *pgborrowbmp(uint32_t *pixels, int stride, int width, int height) {
@@ -410,6 +1109,26 @@ Canvas *pgnewbmp(int width, int height) {
     return bmp_new(0, width, width, height);
 }
 
+// Store pixels in another format, so they can go straight to a surface.
+Canvas *pgpixelformat(Canvas *g, int format) {
+    if (g && g->_ == &bitmapmethods) {
+        Bitmap  *bmp = (Bitmap*) g;
+        bmp->format = format & 3;
+        if (bmp->shared)
+            bmp->shared->header->format = bmp->format;
+    }
+    return g;
+}
+
+// A colour as stored in a bitmap of this format.
+static inline Colour fmtcolour(Colour c, int format) {
+    if (format & 1)
+        c = rgba(c.b, c.g, c.r, c.a);
+    if (format & 2)
+        c = rgba(c.r * c.a, c.g * c.a, c.b * c.a, c.a);
+    return c;
+}
+
 static Path *bmp_path(Canvas *g) {
     return ((Bitmap*) g)->path;
 }
@@ -428,8 +1147,16 @@ static IntRect bmp_dirtyrect(Rect dirty, Rect clip) {
 
 static void bmp_free(Canvas *g) {
     Bitmap  *bmp = (Bitmap *) g;
-    if (bmp->ownpixels)
+    if (bmp->shared)
+        freeshared(bmp->shared);
+    else if (bmp->ownpixels)
         free(bmp->pixels);
+    pgfreepath(bmp->path);
+}
+
+static void bmp_origin(Canvas *g, int dx, int dy) {
+    Bitmap  *bmp = (Bitmap *) g;
+    bmp->pixels += dy * bmp->stride + dx;
 }
 
 static void bmp_clean(Canvas *g) {
@@ -464,50 +1191,329 @@ static void bmp_setctm(Canvas *g, CTM ctm) {
     (void) ctm;
 }
 
+// Columns within a row of marks.
+static inline int markstride(int stride) {
+    return (stride + MARK_RUN - 1) / MARK_RUN;
+}
+
+// Coverage from the accumulated winding.  Rounding leaves a trace of
+// winding where edges cancel; under half a level is none, as it is for
+// the scanline rasterizer.
+static inline float coverage(float a, int fillrule) {
+    if (fillrule == PG_EVENODD) {
+        a = fabsf(a) - 2 * floorf(fabsf(a) * 0.5f);
+        a = a > 1? 2 - a: a;
+    } else
+        a = fminf(fabsf(a), 1);
+    return a < 1 / 512.0f? 0: a;
+}
+
+// Blend colour, already in format, into a pixel by coverage a.
+// Premultiplied bitmaps composite source-over.
+static inline uint32_t blendpx(
+    uint32_t    bg,
+    uint32_t    c,
+    Colour      colour,
+    bool        linear,
+    float       a,
+    int         format)
+{
+    if (format & 2)
+        return linear? blendlinearover(bg, c, a): blendover(bg, colour, a);
+    return linear? blendlinear(bg, c, a): blendinto(bg, colour, a);
+}
+
+// Blend a run of pixels that share one coverage.
+static inline void bmp_run(
+    uint32_t * restrict p,
+    int         n,
+    uint32_t    c,
+    Colour      colour,
+    bool        linear,
+    float       a,
+    int         format)
+{
+    if (a == 0)
+        return;
+    if (a == 1 && (~format & 2 || colour.a == 1))
+        for (int x = 0; x < n; x++)
+            p[x] = c;
+    else
+        for (int x = 0; x < n; x++)
+            p[x] = blendpx(p[x], c, colour, linear, a, format);
+}
+
+// Blend accumulated coverage in r; p points at the pixels of row r.ay.
 static inline void bmp_accum(
     IntRect     r,
     int         stride,
     Colour      colour,
+    bool        linear,
+    int         format,
     uint32_t * restrict p,
-    float * restrict b)
+    BitmapBuf   *buf)
 {
-    p += r.ay * stride;
-    b += r.ay * stride;
+    uint32_t    c = packrgb(colour);
+    int         mstride = markstride(buf->stride);
+    float       * restrict b = buf->buf + (r.ay - buf->top) * buf->stride;
+    uint8_t     *m = buf->marks + (r.ay - buf->top) * mstride;
+
     for (int y = r.ay; y < r.by; y++) {
         float   a = 0;
-        for (int x = r.ax; x < r.bx; x++) {
-            a += b[x];
-            p[x] = blendinto(p[x], colour, fminf(fabsf(a), 1));
-            b[x] = 0;
+        for (int x = r.ax; x < r.bx; ) {
+
+            // Unmarked runs have no edges, so coverage stays constant.
+            int     end = x;
+            while (end < r.bx && !m[end / MARK_RUN])
+                end = (end / MARK_RUN + 1) * MARK_RUN;
+            end = end < r.bx? end: r.bx;
+            if (end > x) {
+                bmp_run(p + x, end - x, c, colour, linear,
+                    coverage(a, buf->fillrule), format);
+                x = end;
+                continue;
+            }
+
+            end = (x / MARK_RUN + 1) * MARK_RUN;
+            end = end < r.bx? end: r.bx;
+            for ( ; x < end; x++) {
+                a += b[x];
+                p[x] = blendpx(p[x], c, colour, linear,
+                    coverage(a, buf->fillrule), format);
+                b[x] = 0;
+            }
         }
         p += stride;
-        b += stride;
+        b += buf->stride;
+        m += mstride;
     }
 }
 
-static void bmp_edge(BitmapBuf *g, Point a, Point b) {
-
-    a = pgapplyctm(g->ctm, a);
-    b = pgapplyctm(g->ctm, b);
+// Accumulate coverage through a shaded paint.
+// Only the covered part of each row is shaded. Paints shade ARGB, which is
+// converted to format; straight pixels are blended by coverage times the
+// paint's alpha, as a solid colour's would be.
+static inline void bmp_accumpaint(
+    IntRect     r,
+    int         stride,
+    const Paint *paint,
+    CTM         inv,
+    bool        linear,
+    int         format,
+    uint32_t * restrict p,
+    BitmapBuf   *buf)
+{
+    uint32_t    *span = malloc((r.bx - r.ax + 4) * sizeof *span);
+    float       * restrict b = buf->buf + (r.ay - buf->top) * buf->stride;
 
-    // Pixels are centred on (.5, .5) in screen co-ordinates.
-    a.x += 0.5f;
-    a.y += 0.5f;
-    b.x += 0.5f;
-    b.y += 0.5f;
+    for (int y = r.ay; y < r.by; y++) {
+        float   a = 0;
+        int     lo = r.bx;
+        int     hi = r.ax;
+        for (int x = r.ax; x < r.bx; x++) {
+            a += b[x];
+            b[x] = coverage(a, buf->fillrule);
+            if (b[x] > 0) {
+                lo = x < lo? x: lo;
+                hi = x + 1;
+            }
+        }
 
-    // Clip line iff no vertical points are on screen.
-    if (fmaxf(a.y, b.y) < g->clip.ay)
-        return;
-    if (fminf(a.y, b.y) > g->clip.by)
-        return;
+        if (lo < hi)
+            shade(paint, inv, lo, y, hi - lo, span);
+        for (int x = 0; format && x < hi - lo; x += 4) {
+            v4u     px;
+            memcpy(&px, span + x, sizeof px);
+            px = convertpx(px, PG_ARGB, format);
+            memcpy(span + x, &px, sizeof px);
+        }
+        for (int x = lo; x < hi; x++) {
+            uint32_t    c = span[x - lo];
+            float       a = format & 2? b[x]: b[x] * (c >> 24) / 255.0f;
+            if (a > 0)
+                p[x] = blendpx(p[x], c, unpackrgb(c), linear, a, format);
+        }
+        memset(b + r.ax, 0, (r.bx - r.ax) * sizeof *b);
 
-    float   sign = 1;
-    if (b.y < a.y) {
-        Point   t = a;
-        a = b;
-        b = t;
-        sign = -1;
+        p += stride;
+        b += buf->stride;
+    }
+    free(span);
+}
+
+// Blend colour into n pixels, each with its own coverage.
+static inline void bmp_cover(
+    uint32_t * restrict p,
+    const float * restrict a,
+    int         n,
+    Colour      colour,
+    bool        linear,
+    int         format)
+{
+    Colour      fg = fmtcolour(colour, format);
+    uint32_t    c = packrgb(fg);
+    for (int x = 0; x < n; x++)
+        bmp_run(p + x, 1, c, fg, linear, a[x], format);
+}
+
+static inline void bmp_solid(
+    IntRect     r,
+    int         stride,
+    Colour      colour,
+    int         format,
+    uint32_t * restrict p)
+{
+    uint32_t    c = packrgb(fmtcolour(colour, format));
+    for (int y = r.ay; y < r.by; y++) {
+        for (int x = r.ax; x < r.bx; x++)
+            p[x] = c;
+        p += stride;
+    }
+}
+
+// The kernels above specialised for each pixel format. Colours are given
+// as ARGB; p points at the pixels of row r.ay.
+typedef struct {
+    void    (*solid)(IntRect r, int stride, Colour colour, uint32_t *p);
+    void    (*accum)(IntRect r, int stride, Colour colour, bool linear,
+                uint32_t *p, BitmapBuf *buf);
+    void    (*accumpaint)(IntRect r, int stride, const Paint *paint,
+                CTM inv, bool linear, uint32_t *p, BitmapBuf *buf);
+    void    (*cover)(uint32_t *p, const float *a, int n, Colour colour,
+                bool linear);
+} PixelKernels;
+
+#define PIXEL_KERNELS(name, format)                                         \
+    static void name##_solid(IntRect r, int stride, Colour colour,          \
+        uint32_t *p)                                                        \
+    {                                                                       \
+        bmp_solid(r, stride, colour, format, p);                            \
+    }                                                                       \
+    static void name##_accum(IntRect r, int stride, Colour colour,          \
+        bool linear, uint32_t *p, BitmapBuf *buf)                           \
+    {                                                                       \
+        bmp_accum(r, stride, fmtcolour(colour, format), linear, format, p,  \
+            buf);                                                           \
+    }                                                                       \
+    static void name##_accumpaint(IntRect r, int stride,                    \
+        const Paint *paint, CTM inv, bool linear, uint32_t *p,              \
+        BitmapBuf *buf)                                                     \
+    {                                                                       \
+        bmp_accumpaint(r, stride, paint, inv, linear, format, p, buf);      \
+    }                                                                       \
+    static void name##_cover(uint32_t *p, const float *a, int n,            \
+        Colour colour, bool linear)                                         \
+    {                                                                       \
+        bmp_cover(p, a, n, colour, linear, format);                         \
+    }
+
+PIXEL_KERNELS(argb, PG_ARGB)
+PIXEL_KERNELS(abgr, PG_ABGR)
+PIXEL_KERNELS(pargb, PG_PARGB)
+PIXEL_KERNELS(pabgr, PG_PABGR)
+
+static const PixelKernels pixelkernels[] = {
+    { argb_solid, argb_accum, argb_accumpaint, argb_cover },
+    { abgr_solid, abgr_accum, abgr_accumpaint, abgr_cover },
+    { pargb_solid, pargb_accum, pargb_accumpaint, pargb_cover },
+    { pabgr_solid, pabgr_accum, pabgr_accumpaint, pabgr_cover },
+};
+
+static inline const PixelKernels *kernels(const Bitmap *bmp) {
+    return pixelkernels + (bmp->format & 3);
+}
+
+// Cells left of the clip carry their winding into its first column; cells
+// right of it can never reach a visible pixel.
+static inline void addcell(float *buf, float x, float v, float cax, float cbx)
+{
+    x = floorf(x);
+    if (x <= cbx)
+        buf[(int) fmaxf(cax, x)] += v;
+}
+
+// Aliased coverage: a whole step of winding at the first pixel whose centre
+// is right of where the edge crosses the middle of the row.
+static inline void bmp_crossing(
+    float * restrict buf,
+    uint8_t * restrict mark,
+    float       x,
+    float       sign,
+    float       cax,
+    float       cbx)
+{
+    x = ceilf(x - 0.5f);
+    addcell(buf, x, sign, cax, cbx);
+    mark[(int) clamp(cax, x, cbx) / MARK_RUN] = 1;
+}
+
+// Add the area coverage of one row of an edge, from x0 to x1 and dy high,
+// marking the runs of columns it touches.
+static inline void bmp_cells(
+    float * restrict buf,
+    uint8_t * restrict mark,
+    float       x0,
+    float       x1,
+    float       dy,
+    float       sign,
+    float       cax,
+    float       cbx)
+{
+    float   lx = fminf(x0, x1);
+    float   rx = fmaxf(x0, x1);
+    int     l = clamp(cax, lx, cbx);
+    int     h = clamp(cax, floorf(rx) + 1, cbx);
+
+    for (int i = l / MARK_RUN; i <= h / MARK_RUN; i++)
+        mark[i] = 1;
+
+    if (floorf(lx) == floorf(rx)) {
+        float   fx = floorf(lx) + 1;
+        float   area = 0.5f * ((fx - lx) + (fx - rx)) * dy;
+        addcell(buf, lx, sign * area, cax, cbx);
+        addcell(buf, lx + 1, sign * (dy - area), cax, cbx);
+    }
+    else {
+        // Coverage rises by dydx per column; buf holds the differences.
+        float   dydx = dy / (rx - lx);
+        float   mx = floorf(lx) + 1;
+        float   fx = floorf(rx);
+        float   prev = 0.5f * (mx - lx) * (mx - lx) * dydx;
+        float   shade = (mx - lx + 0.5f) * dydx;
+        float   last = dy - 0.5f * (rx - fx) * (rx - fx) * dydx;
+
+        addcell(buf, lx, sign * prev, cax, cbx);
+        for (float x = mx; x < fx; x++) {
+            addcell(buf, x, sign * (shade - prev), cax, cbx);
+            prev = shade;
+            shade += dydx;
+        }
+        addcell(buf, fx, sign * (last - prev), cax, cbx);
+        addcell(buf, fx + 1, sign * (dy - last), cax, cbx);
+    }
+}
+
+// Add an edge already in device space.
+static void bmp_devedge(BitmapBuf *g, Point a, Point b) {
+
+    // Pixels are centred on (.5, .5) in screen co-ordinates.
+    a.x += 0.5f;
+    a.y += 0.5f;
+    b.x += 0.5f;
+    b.y += 0.5f;
+
+    // Clip line iff no vertical points are on screen.
+    if (fmaxf(a.y, b.y) < g->clip.ay)
+        return;
+    if (fminf(a.y, b.y) > g->clip.by)
+        return;
+
+    float   sign = 1;
+    if (b.y < a.y) {
+        Point   t = a;
+        a = b;
+        b = t;
+        sign = -1;
     }
 
     g->dirty = (Rect) {{
@@ -517,48 +1523,38 @@ static void bmp_edge(BitmapBuf *g, Point a, Point b) {
         fmaxf(g->dirty.by, fmaxf(a.y, b.y)),
     }};
 
-    float   x = a.x;
     float   dxdy = (b.x - a.x) / (b.y - a.y);
     float   maxy = fminf(ceilf(b.y), g->clip.by);
     float   miny = fmaxf(floorf(a.y), g->clip.ay);
     float   cax = g->clip.ax;
     float   cbx = truncf(g->clip.bx) - 1;
-    if (miny != floorf(a.y))
-        x += dxdy * (miny - floorf(a.y));
 
+    if (g->aliased) {
+        for (float y = miny; y < maxy; y++)
+            if (a.y <= y + 0.5f && y + 0.5f < b.y)
+                bmp_crossing(g->buf + ((int) y - g->top) * g->stride,
+                    g->marks + ((int) y - g->top) * markstride(g->stride),
+                    a.x + (y + 0.5f - a.y) * dxdy, sign, cax, cbx);
+        return;
+    }
+
+    // Each row is placed from the start of the edge rather than stepped
+    // from the last, so long edges do not drift and a clipped edge lands
+    // exactly where it would unclipped.
     for (float y = miny; y < maxy; y++) {
-        float * restrict buf = g->buf + (int) y * g->stride;
-        float   dy = fminf(b.y, y + 1) - fmaxf(a.y, y);
-        float   nextx = x + dxdy * dy;
-        float   lx = fminf(x, nextx);
-        float   rx = fmaxf(x, nextx);
-        x = nextx;
-
-        if (floorf(lx) == floorf(rx)) {
-            float   fx = floorf(lx) + 1;
-            float   area = 0.5f * ((fx - lx) + (fx - rx)) * dy;
-            buf[(int) clamp(cax, lx, cbx)] += sign * area;
-            buf[(int) clamp(cax, lx + 1, cbx)] += sign * (dy - area);
-        }
-        else {
-            float   dydx = dy / (rx - lx);
-            float   mx = floorf(lx) + 1;
-            float   my = (mx - lx) * dydx;
-            float   larea = 0.5f * (mx - lx) * my;
-            float   shade = my;
-            float   fx = floorf(rx);
-
-            buf[(int) clamp(cax, lx, cbx)] += sign * larea;
-            buf[(int) clamp(cax, mx, cbx)] += sign * (shade - larea);
-            for (int x = clamp(cax, mx, cbx); x < clamp(cax, fx, cbx); x++) {
-                buf[(int) x] += sign * dydx;
-                shade += dydx;
-            }
-            buf[(int) clamp(cax, fx, cbx)] += sign * (dy - shade);
-        }
+        float   y0 = fmaxf(a.y, y);
+        float   y1 = fminf(b.y, y + 1);
+        bmp_cells(g->buf + ((int) y - g->top) * g->stride,
+            g->marks + ((int) y - g->top) * markstride(g->stride),
+            a.x + dxdy * (y0 - a.y), a.x + dxdy * (y1 - a.y), y1 - y0,
+            sign, cax, cbx);
     }
 }
 
+static void bmp_edge(BitmapBuf *g, Point a, Point b) {
+    bmp_devedge(g, pgapplyctm(g->ctm, a), pgapplyctm(g->ctm, b));
+}
+
 static int
 flatten3(Point *out, Point a, Point b, Point c, int lim) {
     float   dcontrol = distance(a, b) + distance(b, c);
@@ -600,40 +1596,143 @@ flatten4(Point *out, Point a, Point b, Point c, Point d, int lim) {
     }
 }
 
-static IntRect bmp_trace(BitmapBuf *g, Path *path) {
-    Point   cur;
-    int     n;
+// Transform points two at a time.
+static void transformpts(Point *out, const Point *in, int n, CTM m) {
+    v4f     ma = { m.a, m.b, m.a, m.b };
+    v4f     mc = { m.c, m.d, m.c, m.d };
+    v4f     me = { m.e, m.f, m.e, m.f };
+    int     i = 0;
+
+    for ( ; i + 2 <= n; i += 2) {
+        v4f     p;
+        memcpy(&p, in + i, sizeof p);
+        v4f     xx = { p[0], p[0], p[2], p[2] };
+        v4f     yy = { p[1], p[1], p[3], p[3] };
+        v4f     r = ma * xx + mc * yy + me;
+        memcpy(out + i, &r, sizeof r);
+    }
+    for ( ; i < n; i++)
+        out[i] = pgapplyctm(m, in[i]);
+}
+
+// Segments needed to keep a curve within TOLERANCE pixels of its chords.
+static int bezsegments(float k, float dd) {
+    return clamp(1, ceilf(sqrtf(k * dd / TOLERANCE)), 1 << BEZ_LIMIT);
+}
+
+// Store four points from separate x and y vectors.
+static inline void storepts(Point *out, v4f x, v4f y) {
+    v4f     lo = { x[0], y[0], x[1], y[1] };
+    v4f     hi = { x[2], y[2], x[3], y[3] };
+    memcpy(out, &lo, sizeof lo);
+    memcpy(out + 2, &hi, sizeof hi);
+}
+
+// Length of a curve's second difference.
+static inline float bend(Point a, Point b, Point c) {
+    return hypotf(a.x - 2 * b.x + c.x, a.y - 2 * b.y + c.y);
+}
+
+// Evaluate device-space curves four parameters at a time.
+// out must have room for three points beyond the segment count.
+static int flatten3v(Point *out, Point a, Point b, Point c) {
+    int     n = bezsegments(0.25f, bend(a, b, c));
+
+    for (int i = 0; i < n; i += 4) {
+        v4f     t = ((v4f) { 1, 2, 3, 4 } + (float) i) / (float) n;
+        v4f     mt = 1 - t;
+        v4f     wa = mt * mt;
+        v4f     wb = 2 * mt * t;
+        v4f     wc = t * t;
+        storepts(out + i,
+            wa * a.x + wb * b.x + wc * c.x,
+            wa * a.y + wb * b.y + wc * c.y);
+    }
+    out[n - 1] = c;
+    return n;
+}
+
+static int flatten4v(Point *out, Point a, Point b, Point c, Point d) {
+    int     n = bezsegments(0.75f, fmaxf(bend(a, b, c), bend(b, c, d)));
+
+    for (int i = 0; i < n; i += 4) {
+        v4f     t = ((v4f) { 1, 2, 3, 4 } + (float) i) / (float) n;
+        v4f     mt = 1 - t;
+        v4f     wa = mt * mt * mt;
+        v4f     wb = 3 * mt * mt * t;
+        v4f     wc = 3 * mt * t * t;
+        v4f     wd = t * t * t;
+        storepts(out + i,
+            wa * a.x + wb * b.x + wc * c.x + wd * d.x,
+            wa * a.y + wb * b.y + wc * c.y + wd * d.y);
+    }
+    out[n - 1] = d;
+    return n;
+}
+
+// Curves wholly above or below the clip only need their chord.
+static inline bool offscreen(Rect clip, float y0, float y1, float y2, float y3)
+{
+    return fmaxf(fmaxf(y0, y1), fmaxf(y2, y3)) + 0.5f < clip.ay ||
+        fminf(fminf(y0, y1), fminf(y2, y3)) + 0.5f > clip.by;
+}
+
+// Transform path into device space and flatten it into edges (point pairs).
+static int buildedges(EdgeList *e, Path *path, CTM ctm, Rect clip) {
+    Point   tmp[(1 << BEZ_LIMIT) + 3];
+    Point   cur = {0, 0};
+    int     n = 0;
+
+    if (e->ptscap < path->np) {
+        e->ptscap = path->np;
+        e->pts = realloc(e->pts, e->ptscap * sizeof *e->pts);
+    }
+    transformpts(e->pts, path->pts, path->np, ctm);
+
+    Point   *p = e->pts;
+    for (int i = 0; i < path->np; cur = p[i - 1]) {
+        Point   *seg = tmp;
+        int     nseg;
 
-    for (int i = 0; i < path->np; cur = path->pts[i - 1])
         switch (path->shapes[i]) {
         case 0: // Move.
             i++;
-            break;
+            continue;
         case 1: // Line.
-            bmp_edge(g, cur, path->pts[i]);
+            seg = p + i;
+            nseg = 1;
             i++;
             break;
         case 2: // Curve3
-            n = flatten3(g->tmp, cur, path->pts[i], path->pts[i + 1],
-                BEZ_LIMIT);
-            for (int i = 0; i < n; i++) {
-                bmp_edge(g, cur, g->tmp[i]);
-                cur = g->tmp[i];
+            if (offscreen(clip, cur.y, p[i].y, p[i + 1].y, cur.y)) {
+                seg = p + i + 1;
+                nseg = 1;
             }
+            else
+                nseg = flatten3v(tmp, cur, p[i], p[i + 1]);
             i += 2;
             break;
-        case 3: // Curve4
-            n = flatten4(g->tmp, cur, path->pts[i], path->pts[i + 1],
-                path->pts[i + 2], BEZ_LIMIT);
-            for (int i = 0; i < n; i++) {
-                bmp_edge(g, cur, g->tmp[i]);
-                cur = g->tmp[i];
+        default: // Curve4
+            if (offscreen(clip, cur.y, p[i].y, p[i + 1].y, p[i + 2].y)) {
+                seg = p + i + 2;
+                nseg = 1;
             }
+            else
+                nseg = flatten4v(tmp, cur, p[i], p[i + 1], p[i + 2]);
             i += 3;
             break;
         }
 
-    return bmp_dirtyrect(g->dirty, g->clip);
+        if (n + nseg * 2 > e->edgecap) {
+            e->edgecap = (n + nseg * 2) * 2;
+            e->edges = realloc(e->edges, e->edgecap * sizeof *e->edges);
+        }
+        for (int j = 0; j < nseg; j++) {
+            e->edges[n++] = cur;
+            e->edges[n++] = cur = seg[j];
+        }
+    }
+    return n / 2;
 }
 
 static void bmp_thick(BitmapBuf *g, float stroke, Point p0, Point p1) {
@@ -688,33 +1787,417 @@ static IntRect bmp_tracelines(BitmapBuf *g, float stroke, Path *path) {
     return bmp_dirtyrect(g->dirty, g->clip);
 }
 
-static inline BitmapBuf initbitmapbuf(Bitmap *bmp, Point *tmp) {
+// Only the rows inside the clip are allocated, so clipped canvases need no
+// more memory than their clip.
+static inline BitmapBuf initbitmapbuf(Canvas *g, Point *tmp) {
+    int     top = g->clip.ay;
+    int     rows = fmaxf(0, ceilf(g->clip.by) - top);
+
     return (BitmapBuf) {
-        .buf = calloc(bmp->stride * bmp->g.height, sizeof(float)),
-        .stride = bmp->stride,
-        .clip = bmp->g.clip,
-        .dirty = {{ bmp->g.width, bmp->g.height, 0, 0 }},
-        .ctm = bmp->g.ctm,
+        .buf = calloc((size_t) g->width * rows, sizeof(float)),
+        .stride = g->width,
+        .marks = calloc((size_t) markstride(g->width) * rows, 1),
+        .top = top,
+        .aliased = g->aliased,
+        .fillrule = g->fillrule,
+        .clip = g->clip,
+        .dirty = {{ g->width, g->height, 0, 0 }},
+        .ctm = g->ctm,
         .tmp = tmp,
     };
 }
 
-static void bmp_fill(Canvas *g, Colour colour) {
-    Bitmap      *bmp = (Bitmap*) g;
-    Point       tmp[1 << BEZ_LIMIT];
-    BitmapBuf   buf = initbitmapbuf(bmp, tmp);
-    IntRect     r = bmp_trace(&buf, bmp->path);
-    bmp_accum(r, bmp->stride, colour, bmp->pixels, buf.buf);
-    free(buf.buf);
+static inline void freebitmapbuf(BitmapBuf *buf) {
+    free(buf->marks);
+    free(buf->buf);
 }
 
 static void bmp_stroke(Canvas *g, float stroke, Colour colour) {
     Bitmap      *bmp = (Bitmap*) g;
     Point       tmp[1 << BEZ_LIMIT];
-    BitmapBuf   buf = initbitmapbuf(bmp, tmp);
+    BitmapBuf   buf = initbitmapbuf(g, tmp);
+    buf.fillrule = PG_NONZERO;
     IntRect     r = bmp_tracelines(&buf, stroke, bmp->path);
-    bmp_accum(r, bmp->stride, colour, bmp->pixels, buf.buf);
-    free(buf.buf);
+    kernels(bmp)->accum(r, bmp->stride, colour, g->linear, bmprow(bmp, r.ay),
+        &buf);
+    freebitmapbuf(&buf);
+}
+
+// Resolve accumulated coverage in r onto a canvas.
+typedef void Render(Canvas *g, BitmapBuf *buf, IntRect r, const Paint *paint);
+
+static void bmp_render(Canvas *g, BitmapBuf *buf, IntRect r,
+    const Paint *paint)
+{
+    Bitmap  *bmp = (Bitmap*) g;
+    CTM     inv = pginvertctm(g->ctm);
+
+    if (paint->type == 0)
+        kernels(bmp)->accum(r, bmp->stride, paint->colour, g->linear,
+            bmprow(bmp, r.ay), buf);
+    else
+        kernels(bmp)->accumpaint(r, bmp->stride, paint, inv, g->linear,
+            bmprow(bmp, r.ay), buf);
+}
+
+// Large sparse paths are cheaper to scan convert than to accumulate in a
+// buffer the size of the canvas.
+static bool bmp_sparse(const Point *e, int n, Rect clip) {
+    Rect    r = {{ INFINITY, INFINITY, -INFINITY, -INFINITY }};
+    float   len = 0;
+
+    for (int i = 0; i < n * 2; i += 2) {
+        len += fabsf(e[i + 1].x - e[i].x) + fabsf(e[i + 1].y - e[i].y);
+        r.ax = fminf(r.ax, fminf(e[i].x, e[i + 1].x));
+        r.ay = fminf(r.ay, fminf(e[i].y, e[i + 1].y));
+        r.bx = fmaxf(r.bx, fmaxf(e[i].x, e[i + 1].x));
+        r.by = fmaxf(r.by, fmaxf(e[i].y, e[i + 1].y));
+    }
+    float   w = fminf(r.bx, clip.bx) - fmaxf(r.ax, clip.ax);
+    float   h = fminf(r.by, clip.by) - fmaxf(r.ay, clip.ay);
+    return w > 0 && h > 0 && w * h > SCANLINE_AREA && w * h > len * 16;
+}
+
+typedef struct {
+    float       ax;
+    float       ay;
+    float       by;
+    float       dxdy;
+    float       sign;
+} ScanEdge;
+
+typedef struct {
+    int         l;          // Columns touched by an edge in this row.
+    int         h;
+    float       w;          // Winding it adds to the columns to its right.
+    int         edge;
+} ScanSpan;
+
+static int scanedgecmp(const void *a, const void *b) {
+    float   ya = ((const ScanEdge*) a)->ay;
+    float   yb = ((const ScanEdge*) b)->ay;
+    return (ya > yb) - (ya < yb);
+}
+
+// Scan convert edges one row at a time through a sorted edge table and an
+// active edge list kept in x order. Each row is rendered as the spans where
+// its winding is non-zero, so the gaps between shapes are never touched.
+static void bmp_scanfill(Canvas *g, const Point *e, int n, Point offset,
+    const Paint *paint, Render *render)
+{
+    Rect        clip = g->clip;
+    ScanEdge    *edges = malloc(n * sizeof *edges);
+    int         *active = malloc(n * sizeof *active);
+    ScanSpan    *spans = malloc(n * sizeof *spans);
+    float       top = INFINITY;
+    float       bottom = -INFINITY;
+    int         ne = 0;
+
+    for (int i = 0; i < n * 2; i += 2) {
+        Point   a = pt(e[i].x + offset.x + 0.5f, e[i].y + offset.y + 0.5f);
+        Point   b = pt(e[i + 1].x + offset.x + 0.5f,
+                    e[i + 1].y + offset.y + 0.5f);
+        float   sign = 1;
+
+        if (a.y == b.y)
+            continue;
+        if (b.y < a.y) {
+            Point   t = a;
+            a = b;
+            b = t;
+            sign = -1;
+        }
+        edges[ne++] = (ScanEdge) {
+            a.x, a.y, b.y, (b.x - a.x) / (b.y - a.y), sign
+        };
+        top = fminf(top, a.y);
+        bottom = fmaxf(bottom, b.y);
+    }
+    qsort(edges, ne, sizeof *edges, scanedgecmp);
+
+    float       cax = clip.ax;
+    float       cbx = truncf(clip.bx) - 1;
+    int         miny = fmaxf(floorf(top), clip.ay);
+    int         maxy = fminf(ceilf(bottom), clip.by);
+    BitmapBuf   row = {
+                    .buf = calloc(g->width + 1, sizeof(float)),
+                    .marks = calloc(markstride(g->width + 1), 1),
+                    .aliased = g->aliased,
+                    .fillrule = g->fillrule,
+                };
+    int         next = 0;
+    int         nactive = 0;
+
+    for (int y = miny; y < maxy && cax <= cbx; y++) {
+        int     nspans = 0;
+
+        while (next < ne && edges[next].ay < y + 1)
+            active[nactive++] = next++;
+
+        for (int i = 0; i < nactive; i++) {
+            ScanEdge    *s = &edges[active[i]];
+            if (s->by <= y)
+                continue;
+
+            ScanSpan    span = { 0, 0, 0, active[i] };
+            if (row.aliased) {
+                float   x = s->ax + (y + 0.5f - s->ay) * s->dxdy;
+                if (s->ay <= y + 0.5f && y + 0.5f < s->by) {
+                    bmp_crossing(row.buf, row.marks, x, s->sign, cax, cbx);
+                    span.w = s->sign;
+                }
+                span.l = clamp(cax, ceilf(x - 0.5f), cbx);
+                span.h = span.l + 1;
+            }
+            else {
+                float   y0 = fmaxf(s->ay, y);
+                float   y1 = fminf(s->by, y + 1);
+                float   x0 = s->ax + (y0 - s->ay) * s->dxdy;
+                float   x1 = s->ax + (y1 - s->ay) * s->dxdy;
+                bmp_cells(row.buf, row.marks, x0, x1, y1 - y0, s->sign,
+                    cax, cbx);
+                span.l = clamp(cax, floorf(fminf(x0, x1)), cbx);
+                span.h = clamp(cax, floorf(fmaxf(x0, x1)) + 1, cbx) + 1;
+                span.w = s->sign * (y1 - y0);
+            }
+
+            // Insertion sort by column; the order barely changes per row.
+            int     j = nspans++;
+            for ( ; j > 0 && spans[j - 1].l > span.l; j--)
+                spans[j] = spans[j - 1];
+            spans[j] = span;
+        }
+
+        nactive = nspans;
+        for (int i = 0; i < nspans; i++)
+            active[i] = spans[i].edge;
+
+        // Split the row wherever the winding returns to zero.
+        float   w = 0;
+        int     lo = 0;
+        int     hi = 0;
+        for (int i = 0; i < nspans; i++) {
+            if (i == 0 || (fabsf(w) < 1 / 512.0f && spans[i].l >= hi)) {
+                if (i > 0)
+                    render(g, &row, (IntRect) { lo, y, hi, y + 1 }, paint);
+                lo = spans[i].l;
+            }
+            hi = spans[i].h > hi? spans[i].h: hi;
+            w += spans[i].w;
+        }
+        if (nspans) {
+            render(g, &row, (IntRect) { lo, y, hi, y + 1 }, paint);
+            memset(row.marks + spans[0].l / MARK_RUN, 0,
+                (hi - 1) / MARK_RUN - spans[0].l / MARK_RUN + 1);
+        }
+    }
+
+    free(row.marks);
+    free(row.buf);
+    free(spans);
+    free(active);
+    free(edges);
+}
+
+// Fill device space edges, offset by a translation.
+static void bmp_filledges(Canvas *g, const Point *e, int n, Point offset,
+    const Paint *paint, Render *render)
+{
+    int     rasterizer = g->rasterizer;
+
+    if (rasterizer == PG_AUTO)
+        rasterizer = bmp_sparse(e, n, g->clip)? PG_SCANLINE: PG_DENSE;
+
+    if (rasterizer == PG_SCANLINE) {
+        bmp_scanfill(g, e, n, offset, paint, render);
+        return;
+    }
+
+    BitmapBuf   buf = initbitmapbuf(g, 0);
+    for (int i = 0; i < n * 2; i += 2)
+        bmp_devedge(&buf,
+            pt(e[i].x + offset.x, e[i].y + offset.y),
+            pt(e[i + 1].x + offset.x, e[i + 1].y + offset.y));
+    render(g, &buf, bmp_dirtyrect(buf.dirty, buf.clip), paint);
+    freebitmapbuf(&buf);
+}
+
+// Each thread reuses one edge list for its fills, freed when it exits.
+static pthread_key_t    scratchkey;
+static pthread_once_t   scratchonce = PTHREAD_ONCE_INIT;
+
+static void freescratch(void *data) {
+    EdgeList    *e = data;
+    free(e->pts);
+    free(e->edges);
+    free(e);
+}
+
+static void initscratch(void) {
+    pthread_key_create(&scratchkey, freescratch);
+}
+
+static EdgeList *scratchedges(void) {
+    pthread_once(&scratchonce, initscratch);
+    EdgeList    *e = pthread_getspecific(scratchkey);
+    if (!e) {
+        e = calloc(1, sizeof *e);
+        pthread_setspecific(scratchkey, e);
+    }
+    return e;
+}
+
+static void fillpath(Canvas *g, Path *path, const Paint *paint,
+    Render *render)
+{
+    EdgeList    *scratch = scratchedges();
+    int         n = buildedges(scratch, path, g->ctm, g->clip);
+    bmp_filledges(g, scratch->edges, n, pt(0, 0), paint, render);
+}
+
+static void fillcompiled(Canvas *g, CompiledPath *cp, const Paint *paint,
+    Render *render)
+{
+    CTM         ctm = g->ctm;
+    bool        same =
+                ctm.a == cp->ctm.a &&
+                ctm.b == cp->ctm.b &&
+                ctm.c == cp->ctm.c &&
+                ctm.d == cp->ctm.d;
+
+    // Translation only moves the edges; anything else re-flattens.
+    if (!same)
+        pgcompilepath(cp, cp->path, ctm);
+
+    Point       offset = pt(ctm.e - cp->ctm.e, ctm.f - cp->ctm.f);
+    bmp_filledges(g, cp->edges, cp->nedges, offset, paint, render);
+}
+
+static void bmp_fillpaint(Canvas *g, const Paint *paint) {
+    fillpath(g, bmp_path(g), paint, bmp_render);
+}
+
+static void bmp_fill(Canvas *g, Colour colour) {
+    Paint   solid = { .colour = colour };
+    bmp_fillpaint(g, &solid);
+}
+
+static void bmp_fillcompiled(Canvas *g, CompiledPath *cp, const Paint *paint) {
+    fillcompiled(g, cp, paint, bmp_render);
+}
+
+static void bmp_blit(
+    Canvas      *g,
+    Canvas      *src,
+    IntRect     sr,
+    IntRect     dr,
+    int         filter)
+{
+    Bitmap      *bmp = (Bitmap*) g;
+    Bitmap      view = *(Bitmap*) src;
+    int         sw = sr.bx - sr.ax;
+    int         sh = sr.by - sr.ay;
+    int         dw = dr.bx - dr.ax;
+    int         dh = dr.by - dr.ay;
+    bool        valid =
+                src->_ == &bitmapmethods &&
+                sr.ax >= 0 && sr.ay >= 0 &&
+                sr.bx <= src->width && sr.by <= src->height &&
+                sw > 0 && sh > 0 && dw > 0 && dh > 0;
+    if (!valid)
+        return;
+
+    // Only sample from the source rectangle.
+    view.pixels = bmprow(&view, sr.ay) + sr.ax;
+    view.top = 0;
+    view.g.width = sw;
+    view.g.height = sh;
+
+    IntRect     r = bmp_dirtyrect(
+                    (Rect) {{ dr.ax, dr.ay, dr.bx, dr.by }},
+                    g->clip);
+    float       kx = sw / (float) dw;
+    float       ky = sh / (float) dh;
+    v4f         lane = { 0, 1, 2, 3 };
+    if (r.ax >= r.bx || r.ay >= r.by)
+        return;
+
+    int         ngroups = (r.bx - r.ax + 3) / 4;
+    v4i         *cols = malloc(ngroups * 3 * sizeof *cols);
+
+    // Columns are the same on every row; resolve them once.
+    for (int i = 0; i < ngroups; i++) {
+        v4f     u = ((float) (r.ax + i * 4 - dr.ax) + lane + 0.5f) * kx;
+        v4f     fu = filter == PG_BILINEAR? vfloor(u - 0.5f): vfloor(u);
+        v4i     x0 = __builtin_convertvector(fu, v4i);
+        cols[i * 3] = wrap(x0, sw, PG_PAD);
+        cols[i * 3 + 1] = wrap(x0 + 1, sw, PG_PAD);
+        cols[i * 3 + 2] = __builtin_convertvector((u - 0.5f - fu) * 256.0f, v4i);
+    }
+
+    for (int y = r.ay; y < r.by; y++) {
+        uint32_t    *p = bmprow(bmp, y);
+        float       v = (y - dr.ay + 0.5f) * ky;
+        float       fv = filter == PG_BILINEAR? floorf(v - 0.5f): floorf(v);
+        int         y0 = clamp(0, fv, sh - 1);
+        int         y1 = clamp(0, fv + 1, sh - 1);
+        uint32_t    w = (v - 0.5f - fv) * 256.0f;
+        v4u         wy = { w, w, w, w };
+        v4i         row0 = { y0, y0, y0, y0 };
+        v4i         row1 = { y1, y1, y1, y1 };
+
+        for (int i = 0, x = r.ax; x < r.bx; i++, x += 4) {
+            v4i     x0 = cols[i * 3];
+            v4u     px;
+
+            if (filter == PG_BILINEAR) {
+                v4i     x1 = cols[i * 3 + 1];
+                v4u     wx = (v4u) cols[i * 3 + 2];
+                v4u     top = lerppx(gather(&view, x0, row0),
+                                gather(&view, x1, row0), wx);
+                v4u     bot = lerppx(gather(&view, x0, row1),
+                                gather(&view, x1, row1), wx);
+                px = lerppx(top, bot, wy);
+            } else
+                px = gather(&view, x0, row0);
+            px = convertpx(px, view.format, bmp->format);
+            memcpy(p + x, &px, (r.bx - x < 4? r.bx - x: 4) * sizeof *p);
+        }
+    }
+    free(cols);
+}
+
+// Composite premultiplied src over dst with an opacity of o/256.
+static void composite(
+    uint32_t * restrict dst,
+    const uint32_t * restrict src,
+    int         n,
+    unsigned    o)
+{
+    v4u     ov = { o, o, o, o };
+    int     x = 0;
+
+    for ( ; x + 4 <= n; x += 4) {
+        v4u     s;
+        v4u     d;
+        memcpy(&s, src + x, sizeof s);
+        memcpy(&d, dst + x, sizeof d);
+        s = scalepx(s, ov);
+        v4u     a = s >> 24;
+        d = s + scalepx(d, 256 - (a + (a >> 7)));
+        memcpy(dst + x, &d, sizeof d);
+    }
+    for ( ; x < n; x++) {
+        uint32_t    s = src[x];
+        uint32_t    rb = (s & 0x00ff00ff) * o >> 8 & 0x00ff00ff;
+        uint32_t    ag = (s >> 8 & 0x00ff00ff) * o & 0xff00ff00;
+        uint32_t    a = (rb | ag) >> 24;
+        uint32_t    na = 256 - (a + (a >> 7));
+        uint32_t    d = dst[x];
+        dst[x] = (rb | ag) +
+                ((d & 0x00ff00ff) * na >> 8 & 0x00ff00ff) +
+                ((d >> 8 & 0x00ff00ff) * na & 0xff00ff00);
+    }
 }
 
 static void bmp_strokefill(Canvas *g, float stroke, Colour cs, Colour cf) {
@@ -730,13 +2213,92 @@ static void bmp_clear(Canvas *g, Colour colour) {
                     ceilf(bmp->g.clip.bx),
                     ceilf(bmp->g.clip.by)
                 };
-    uint32_t * restrict p = bmp->pixels + r.ay * bmp->stride;
-    uint32_t    c = packrgb(colour);
+    kernels(bmp)->solid(r, bmp->stride, colour, bmprow(bmp, r.ay));
+}
+
+static inline float sdfsample(const SdfGlyph *sdf, float u, float v) {
+    int     x = floorf(u);
+    int     y = floorf(v);
+    float   fx = u - x;
+    float   fy = v - y;
+    float   t[4];
+
+    for (int i = 0; i < 4; i++) {
+        int     tx = x + (i & 1);
+        int     ty = y + (i >> 1);
+        bool    outside = tx < 0 || ty < 0 ||
+                          tx >= sdf->width || ty >= sdf->height;
+        t[i] = outside? 0: sdf->data[ty * sdf->width + tx];
+    }
+    float   top = t[0] + (t[1] - t[0]) * fx;
+    float   bottom = t[2] + (t[3] - t[2]) * fx;
+    return top + (bottom - top) * fy;
+}
+
+// Pixels a glyph placed by full can touch.
+static IntRect sdfbounds(Canvas *g, const SdfGlyph *sdf, CTM full) {
+    Rect        dirty = {{ g->width, g->height, 0, 0 }};
+
+    for (int i = 0; i < 4; i++) {
+        Point   p = pgapplyctm(full,
+                    pt(i & 1? sdf->width: 0, i & 2? sdf->height: 0));
+        dirty = (Rect) {{
+            fminf(dirty.ax, p.x),
+            fminf(dirty.ay, p.y),
+            fmaxf(dirty.bx, p.x + 1),
+            fmaxf(dirty.by, p.y + 1),
+        }};
+    }
+    return bmp_dirtyrect(dirty, g->clip);
+}
+
+static void bmp_sdf(Canvas *g, const SdfGlyph *sdf, CTM ctm, Colour colour) {
+    Bitmap      *bmp = (Bitmap*) g;
+    CTM         full = pgmulctm(ctm, g->ctm);
+    CTM         inv = pginvertctm(full);
+    IntRect     r = sdfbounds(g, sdf, full);
+
+    // Convert sample units to pixels using the average scale.
+    float       scale = sqrtf(fabsf(full.a * full.d - full.b * full.c));
+    float       k = sdf->spread * scale / 255.0f;
+    float       *a = malloc(fmaxf(1, r.bx - r.ax) * sizeof *a);
+    uint32_t    *p = bmprow(bmp, r.ay);
+
     for (int y = r.ay; y < r.by; y++) {
-        for (int x = r.ax; x < r.bx; x++)
-            p[x] = c;
+        for (int x = r.ax; x < r.bx; x++) {
+            Point   t = pgapplyctm(inv, pt(x, y));
+            float   d = sdfsample(sdf, t.x - 0.5f, t.y - 0.5f);
+            a[x - r.ax] = clamp(0, (d - 127.5f) * k + 0.5f, 1);
+        }
+        kernels(bmp)->cover(p + r.ax, a, r.bx - r.ax, colour, g->linear);
         p += bmp->stride;
     }
+    free(a);
+}
+
+static void bmp_fillmask(Canvas *g, Canvas *mask, int x, int y,
+    Colour colour)
+{
+    if (mask->_ != &maskmethods)
+        return;
+
+    Bitmap      *bmp = (Bitmap*) g;
+    Mask        *msk = (Mask*) mask;
+    IntRect     r = bmp_dirtyrect(
+                    (Rect) {{ x, y, x + mask->width, y + mask->height }},
+                    g->clip);
+    float       *a = malloc(fmaxf(1, r.bx - r.ax) * sizeof *a);
+    uint32_t    *p = bmprow(bmp, r.ay);
+    const uint8_t * restrict m = msk->pixels + (r.ay - y) * msk->stride;
+
+    for (int j = r.ay; j < r.by; j++) {
+        for (int i = r.ax; i < r.bx; i++)
+            a[i - r.ax] = m[i - x] * (1 / 255.0f);
+        kernels(bmp)->cover(p + r.ax, a, r.bx - r.ax, colour, g->linear);
+        p += bmp->stride;
+        m += msk->stride;
+    }
+    free(a);
 }
 
 static const CanvasMethods bitmapmethods = {
@@ -753,43 +2315,1412 @@ static const CanvasMethods bitmapmethods = {
     bmp_fill,
     bmp_stroke,
     bmp_strokefill,
+    bmp_sdf,
+    bmp_fillpaint,
+    bmp_blit,
+    bmp_origin,
+    bmp_fillcompiled,
+    bmp_fillmask,
 };
 
+
 /*
 
-    Fonts.
+    Mask Canvas.
 
-*/
+    An A8 canvas that keeps only coverage. Drawing moves each pixel
+    towards the alpha of the colour or paint by the coverage of the
+    shape, so masks are built with the same paths and glyphs as a Bitmap
+    and applied with pgfillmask().
 
+*/
 
-static Font *otf_openfont(void * restrict data, size_t size, int index);
 
-Font *pgfontfile(const char *file, int index) {
-    struct stat stat;
-    int         fd = open(file, O_RDONLY);
-    int         err = fstat(fd, &stat);
-    if (fd < 0 || err)
+static Canvas *
+msk_new(uint8_t *pixels, int stride, int width, int height) {
+    bool    ownpixels = pixels == 0;
+    if (ownpixels)
+        pixels = calloc((size_t) stride * height, sizeof *pixels);
+    if (!pixels)
         return 0;
 
-    void *data = mmap(0, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-    if (data == MAP_FAILED)
-        return 0;
-    return otf_openfont(data, stat.st_size, index);
-}
+    return new(Mask,
+        {
+            &maskmethods,
+            width,
+            height,
 
-void pgfreefont(Font *font) {
-    if (font) {
-        font->_->free(font);
-        munmap(font->data, font->datasize);
-    }
+            {{ 0, 0, width, height }},
+            { 1, 0, 0, 1, 0, 0 },
+            false,
+            PG_AUTO,
+            false,
+            PG_NONZERO,
+            0,
+            0,
+            0,
+            {{ 0 }},
+        },
+        stride,
+        pixels,
+        ownpixels,
+        pgpath(0),
+    );
 }
 
-Font *pgfontctm(Font *font, CTM ctm) {
-    if (font) {
-        font->_->setctm(font, ctm);
-        font->ctm = ctm;
-    }
+static Canvas *
+msk_subcanvas(Canvas *parent, int ax, int ay, int width, int height) {
+    int     bx = ax + width;
+    int     by = ay + height;
+    bool    valid =
+                ax >= 0 &&
+                bx >= 0 &&
+                ax <= bx &&
+                bx <= parent->width &&
+                ay >= 0 &&
+                by >= 0 &&
+                ay <= by &&
+                by <= parent->height;
+    if (!valid)
+        return 0;
+
+    Mask        *msk = (Mask*) parent;
+    uint8_t     *pixels = msk->pixels + ay * msk->stride + ax;
+    Canvas      *g = msk_new(pixels, msk->stride, width, height);
+    if (g) {
+        g->clip = (Rect) {{
+            clamp(0, parent->clip.ax - ax, width),
+            clamp(0, parent->clip.ay - ay, height),
+            clamp(0, parent->clip.bx - ax, width),
+            clamp(0, parent->clip.by - ay, height),
+        }};
+        g->rasterizer = parent->rasterizer;
+        g->aliased = parent->aliased;
+        g->fillrule = parent->fillrule;
+    }
+    return g;
+}
+
+Canvas *pgborrowmask(uint8_t *pixels, int stride, int width, int height) {
+    return msk_new(pixels, stride, width, height);
+}
+
+Canvas *pgnewmask(int width, int height) {
+    return msk_new(0, width, width, height);
+}
+
+static Path *msk_path(Canvas *g) {
+    return ((Mask*) g)->path;
+}
+
+static void msk_free(Canvas *g) {
+    Mask    *msk = (Mask *) g;
+    if (msk->ownpixels)
+        free(msk->pixels);
+    pgfreepath(msk->path);
+}
+
+static void msk_origin(Canvas *g, int dx, int dy) {
+    Mask    *msk = (Mask *) g;
+    msk->pixels += dy * msk->stride + dx;
+}
+
+static void msk_clean(Canvas *g) {
+    pgpclean(msk_path(g));
+}
+
+static void msk_close(Canvas *g) {
+    if (g && msk_path(g)->open) {
+        Path *path = msk_path(g);
+        pgpline(path, path->pts[path->homeindex]);
+    }
+}
+
+static void msk_move(Canvas *g, Point a) {
+    pgpmove(msk_path(g), a);
+}
+
+static void msk_line(Canvas *g, Point b) {
+    pgpline(msk_path(g), b);
+}
+
+static void msk_curve3(Canvas *g, Point b, Point c) {
+    pgpcurve3(msk_path(g), b, c);
+}
+
+static void msk_curve4(Canvas *g, Point b, Point c, Point d) {
+    pgpcurve4(msk_path(g), b, c, d);
+}
+
+// Move a mask pixel towards v by a.
+static inline uint8_t mixalpha(uint8_t p, float v, float a) {
+    return p + (v - p) * a + 0.5f;
+}
+
+static inline void msk_run(uint8_t * restrict p, int n, float v, float a) {
+    if (a == 0)
+        return;
+    if (a == 1)
+        memset(p, v + 0.5f, n);
+    else
+        for (int x = 0; x < n; x++)
+            p[x] = mixalpha(p[x], v, a);
+}
+
+static void msk_accum(
+    IntRect     r,
+    int         stride,
+    float       v,
+    uint8_t * restrict p,
+    BitmapBuf   *buf)
+{
+    int         mstride = markstride(buf->stride);
+    float       * restrict b = buf->buf + (r.ay - buf->top) * buf->stride;
+    uint8_t     *m = buf->marks + (r.ay - buf->top) * mstride;
+
+    p += r.ay * stride;
+    for (int y = r.ay; y < r.by; y++) {
+        float   a = 0;
+        for (int x = r.ax; x < r.bx; ) {
+            int     end = x;
+            while (end < r.bx && !m[end / MARK_RUN])
+                end = (end / MARK_RUN + 1) * MARK_RUN;
+            end = end < r.bx? end: r.bx;
+            if (end > x) {
+                msk_run(p + x, end - x, v, coverage(a, buf->fillrule));
+                x = end;
+                continue;
+            }
+
+            end = (x / MARK_RUN + 1) * MARK_RUN;
+            end = end < r.bx? end: r.bx;
+            for ( ; x < end; x++) {
+                a += b[x];
+                p[x] = mixalpha(p[x], v, coverage(a, buf->fillrule));
+                b[x] = 0;
+            }
+        }
+        p += stride;
+        b += buf->stride;
+        m += mstride;
+    }
+}
+
+// Only the alpha of a shaded paint reaches the mask.
+static void msk_accumpaint(
+    IntRect     r,
+    int         stride,
+    const Paint *paint,
+    CTM         inv,
+    uint8_t * restrict p,
+    BitmapBuf   *buf)
+{
+    uint32_t    *span = malloc((r.bx - r.ax + 4) * sizeof *span);
+    float       * restrict b = buf->buf + (r.ay - buf->top) * buf->stride;
+
+    p += r.ay * stride;
+    for (int y = r.ay; y < r.by; y++) {
+        float   a = 0;
+        int     lo = r.bx;
+        int     hi = r.ax;
+        for (int x = r.ax; x < r.bx; x++) {
+            a += b[x];
+            b[x] = coverage(a, buf->fillrule);
+            if (b[x] > 0) {
+                lo = x < lo? x: lo;
+                hi = x + 1;
+            }
+        }
+
+        if (lo < hi)
+            shade(paint, inv, lo, y, hi - lo, span);
+        for (int x = lo; x < hi; x++)
+            if (b[x] > 0)
+                p[x] = mixalpha(p[x], span[x - lo] >> 24, b[x]);
+        memset(b + r.ax, 0, (r.bx - r.ax) * sizeof *b);
+
+        p += stride;
+        b += buf->stride;
+    }
+    free(span);
+}
+
+static void msk_render(Canvas *g, BitmapBuf *buf, IntRect r,
+    const Paint *paint)
+{
+    Mask    *msk = (Mask*) g;
+
+    if (paint->type == 0)
+        msk_accum(r, msk->stride, paint->colour.a * 255, msk->pixels, buf);
+    else
+        msk_accumpaint(r, msk->stride, paint, pginvertctm(g->ctm),
+            msk->pixels, buf);
+}
+
+static void msk_stroke(Canvas *g, float stroke, Colour colour) {
+    Mask        *msk = (Mask*) g;
+    Point       tmp[1 << BEZ_LIMIT];
+    BitmapBuf   buf = initbitmapbuf(g, tmp);
+    buf.fillrule = PG_NONZERO;
+    IntRect     r = bmp_tracelines(&buf, stroke, msk->path);
+    msk_accum(r, msk->stride, colour.a * 255, msk->pixels, &buf);
+    freebitmapbuf(&buf);
+}
+
+static void msk_fillpaint(Canvas *g, const Paint *paint) {
+    fillpath(g, msk_path(g), paint, msk_render);
+}
+
+static void msk_fill(Canvas *g, Colour colour) {
+    Paint   solid = { .colour = colour };
+    msk_fillpaint(g, &solid);
+}
+
+static void msk_fillcompiled(Canvas *g, CompiledPath *cp, const Paint *paint) {
+    fillcompiled(g, cp, paint, msk_render);
+}
+
+static void msk_strokefill(Canvas *g, float stroke, Colour cs, Colour cf) {
+    msk_fill(g, cf);
+    msk_stroke(g, stroke, cs);
+}
+
+static void msk_clear(Canvas *g, Colour colour) {
+    Mask        *msk = (Mask *) g;
+    IntRect     r = {
+                    truncf(g->clip.ax),
+                    truncf(g->clip.ay),
+                    ceilf(g->clip.bx),
+                    ceilf(g->clip.by)
+                };
+    uint8_t     *p = msk->pixels + r.ay * msk->stride;
+    for (int y = r.ay; y < r.by; y++) {
+        memset(p + r.ax, colour.a * 255 + 0.5f, r.bx - r.ax);
+        p += msk->stride;
+    }
+}
+
+static void msk_sdf(Canvas *g, const SdfGlyph *sdf, CTM ctm, Colour colour) {
+    Mask        *msk = (Mask*) g;
+    CTM         full = pgmulctm(ctm, g->ctm);
+    CTM         inv = pginvertctm(full);
+    IntRect     r = sdfbounds(g, sdf, full);
+    float       scale = sqrtf(fabsf(full.a * full.d - full.b * full.c));
+    float       k = sdf->spread * scale / 255.0f;
+    uint8_t * restrict p = msk->pixels + r.ay * msk->stride;
+
+    for (int y = r.ay; y < r.by; y++) {
+        for (int x = r.ax; x < r.bx; x++) {
+            Point   t = pgapplyctm(inv, pt(x, y));
+            float   d = sdfsample(sdf, t.x - 0.5f, t.y - 0.5f);
+            float   a = clamp(0, (d - 127.5f) * k + 0.5f, 1);
+            if (a > 0)
+                p[x] = mixalpha(p[x], colour.a * 255, a);
+        }
+        p += msk->stride;
+    }
+}
+
+// Alpha of a mask or bitmap pixel.
+static inline float texelalpha(Canvas *src, int x, int y) {
+    if (src->_ == &maskmethods) {
+        Mask    *msk = (Mask*) src;
+        return msk->pixels[y * msk->stride + x];
+    }
+    Bitmap  *bmp = (Bitmap*) src;
+    return bmprow(bmp, y)[x] >> 24;
+}
+
+// Copy the alpha of a mask or bitmap, scaled like bmp_blit().
+static void msk_blit(
+    Canvas      *g,
+    Canvas      *src,
+    IntRect     sr,
+    IntRect     dr,
+    int         filter)
+{
+    Mask        *msk = (Mask*) g;
+    int         sw = sr.bx - sr.ax;
+    int         sh = sr.by - sr.ay;
+    int         dw = dr.bx - dr.ax;
+    int         dh = dr.by - dr.ay;
+    bool        valid =
+                (src->_ == &maskmethods || src->_ == &bitmapmethods) &&
+                sr.ax >= 0 && sr.ay >= 0 &&
+                sr.bx <= src->width && sr.by <= src->height &&
+                sw > 0 && sh > 0 && dw > 0 && dh > 0;
+    if (!valid)
+        return;
+
+    IntRect     r = bmp_dirtyrect(
+                    (Rect) {{ dr.ax, dr.ay, dr.bx, dr.by }},
+                    g->clip);
+    float       kx = sw / (float) dw;
+    float       ky = sh / (float) dh;
+    float       half = filter == PG_BILINEAR? 0.5f: 0;
+
+    for (int y = r.ay; y < r.by; y++) {
+        uint8_t     *p = msk->pixels + y * msk->stride;
+        float       v = (y - dr.ay + 0.5f) * ky - half;
+        float       fv = floorf(v);
+        int         y0 = sr.ay + clamp(0, fv, sh - 1);
+        int         y1 = sr.ay + clamp(0, fv + 1, sh - 1);
+
+        for (int x = r.ax; x < r.bx; x++) {
+            float   u = (x - dr.ax + 0.5f) * kx - half;
+            float   fu = floorf(u);
+            int     x0 = sr.ax + clamp(0, fu, sw - 1);
+            int     x1 = sr.ax + clamp(0, fu + 1, sw - 1);
+            float   a = texelalpha(src, x0, y0);
+
+            if (filter == PG_BILINEAR) {
+                float   top = a + (texelalpha(src, x1, y0) - a) * (u - fu);
+                float   bot = texelalpha(src, x0, y1) +
+                            (texelalpha(src, x1, y1) -
+                             texelalpha(src, x0, y1)) * (u - fu);
+                a = top + (bot - top) * (v - fv) + 0.5f;
+            }
+            p[x] = a;
+        }
+    }
+}
+
+static void msk_fillmask(Canvas *g, Canvas *mask, int x, int y,
+    Colour colour)
+{
+    if (mask->_ != &maskmethods)
+        return;
+
+    Mask        *dst = (Mask*) g;
+    Mask        *msk = (Mask*) mask;
+    IntRect     r = bmp_dirtyrect(
+                    (Rect) {{ x, y, x + mask->width, y + mask->height }},
+                    g->clip);
+    uint8_t * restrict p = dst->pixels + r.ay * dst->stride;
+    const uint8_t * restrict m = msk->pixels + (r.ay - y) * msk->stride;
+
+    for (int j = r.ay; j < r.by; j++) {
+        for (int i = r.ax; i < r.bx; i++)
+            p[i] = mixalpha(p[i], colour.a * 255, m[i - x] / 255.0f);
+        p += dst->stride;
+        m += msk->stride;
+    }
+}
+
+static const CanvasMethods maskmethods = {
+    msk_free,
+    msk_subcanvas,
+    bmp_setctm,
+    msk_clear,
+    msk_clean,
+    msk_close,
+    msk_move,
+    msk_line,
+    msk_curve3,
+    msk_curve4,
+    msk_fill,
+    msk_stroke,
+    msk_strokefill,
+    msk_sdf,
+    msk_fillpaint,
+    msk_blit,
+    msk_origin,
+    msk_fillcompiled,
+    msk_fillmask,
+};
+
+
+/*
+
+    Layers.
+
+    A layer is a transparent Bitmap covering part of its parent, drawn
+    with the parent's co-ordinates and composited back when popped.
+    Layers are recycled through a small pool so steady-state use does
+    not allocate.
+
+*/
+
+
+typedef struct {
+    Bitmap      bmp;
+    IntRect     r;
+    size_t      capacity;
+} Layer;
+
+static Layer            *layerpool[LAYER_POOL];
+static int              nlayerpool;
+static pthread_mutex_t  layerlock = PTHREAD_MUTEX_INITIALIZER;
+
+static Layer *getlayer(size_t size) {
+    Layer   *layer = 0;
+    int     best = -1;
+
+    // Take the smallest pooled layer that fits, else the largest.
+    pthread_mutex_lock(&layerlock);
+    for (int i = 0; i < nlayerpool; i++) {
+        size_t  cap = layerpool[i]->capacity;
+        size_t  bestcap = best < 0? 0: layerpool[best]->capacity;
+        bool    fits = cap >= size;
+        bool    bestfits = bestcap >= size;
+        if (best < 0 ||
+            (fits && (!bestfits || cap < bestcap)) ||
+            (!fits && !bestfits && cap > bestcap))
+            best = i;
+    }
+    if (best >= 0) {
+        layer = layerpool[best];
+        layerpool[best] = layerpool[--nlayerpool];
+    }
+    pthread_mutex_unlock(&layerlock);
+
+    if (!layer) {
+        layer = calloc(1, sizeof *layer);
+        layer->bmp.path = pgpath(0);
+    }
+    if (layer->capacity < size) {
+        free(layer->bmp.pixels);
+        layer->bmp.pixels = malloc(size * sizeof *layer->bmp.pixels);
+        layer->capacity = layer->bmp.pixels? size: 0;
+    }
+    if (!layer->bmp.pixels) {
+        pgfreepath(layer->bmp.path);
+        free(layer);
+        return 0;
+    }
+    return layer;
+}
+
+static void putlayer(Layer *layer) {
+    pthread_mutex_lock(&layerlock);
+    if (nlayerpool < LAYER_POOL) {
+        layerpool[nlayerpool++] = layer;
+        layer = 0;
+    }
+    pthread_mutex_unlock(&layerlock);
+
+    if (layer) {
+        free(layer->bmp.pixels);
+        pgfreepath(layer->bmp.path);
+        free(layer);
+    }
+}
+
+Canvas *pgpushlayer(Canvas *g, Rect bounds) {
+    if (!g || g->_ != &bitmapmethods)
+        return 0;
+
+    // Device-space bounds, with a pixel of room for anti-aliasing.
+    Rect    dirty = {{ g->width, g->height, 0, 0 }};
+    for (int i = 0; i < 4; i++) {
+        Point   p = pgapplyctm(g->ctm,
+                    pt(i & 1? bounds.bx: bounds.ax, i & 2? bounds.by: bounds.ay));
+        dirty = (Rect) {{
+            fminf(dirty.ax, p.x - 1),
+            fminf(dirty.ay, p.y - 1),
+            fmaxf(dirty.bx, p.x + 2),
+            fmaxf(dirty.by, p.y + 2),
+        }};
+    }
+    IntRect r = bmp_dirtyrect(dirty, g->clip);
+    int     width = r.bx > r.ax? r.bx - r.ax: 0;
+    int     height = r.by > r.ay? r.by - r.ay: 0;
+    Layer   *layer = getlayer((size_t) width * height + 1);
+    if (!layer)
+        return 0;
+
+    Bitmap  *parent = (Bitmap*) g;
+    CTM     ctm = g->ctm;
+    ctm.e -= r.ax;
+    ctm.f -= r.ay;
+
+    layer->bmp.parent = g;
+    layer->r = r;
+    layer->bmp.g = (Canvas) {
+        &bitmapmethods,
+        width,
+        height,
+        {{
+            fmaxf(g->clip.ax - r.ax, 0),
+            fmaxf(g->clip.ay - r.ay, 0),
+            fminf(g->clip.bx - r.ax, width),
+            fminf(g->clip.by - r.ay, height),
+        }},
+        ctm,
+        parent->g.linear,
+        parent->g.rasterizer,
+        parent->g.aliased,
+        parent->g.fillrule,
+        0,
+        0,
+        0,
+        {{ 0 }},
+    };
+    layer->bmp.stride = width;
+    layer->bmp.format = parent->format | PG_PARGB;
+    layer->bmp.ownpixels = true;
+    pgpclean(layer->bmp.path);
+    memset(layer->bmp.pixels, 0, (size_t) width * height * sizeof(uint32_t));
+    return &layer->bmp.g;
+}
+
+Canvas *pgpoplayer(Canvas *g, float opacity) {
+    if (!g || g->_ != &bitmapmethods || !((Bitmap*) g)->parent)
+        return 0;
+
+    while (g->depth)
+        pgrestore(g);
+
+    Layer   *layer = (Layer*) g;
+    Bitmap  *parent = (Bitmap*) layer->bmp.parent;
+    IntRect r = layer->r;
+    unsigned o = clamp(0, opacity, 1) * 256;
+    for (int y = r.ay; y < r.by && o; y++)
+        composite(
+            bmprow(parent, y) + r.ax,
+            layer->bmp.pixels + (y - r.ay) * layer->bmp.stride,
+            r.bx - r.ax,
+            o);
+
+    layer->bmp.parent = 0;
+    putlayer(layer);
+    return &parent->g;
+}
+
+
+/*
+
+    Shared Bitmaps.
+
+    Pixels live in a memfd (or unlinked POSIX shared memory) after a
+    small header describing them, so another local process given the
+    descriptor can map the same frame. The header's generation counter
+    is bumped by the producer when a frame is complete; consumers read
+    it to know when to swap buffers.
+
+*/
+
+
+static int sharedfd(size_t size) {
+#ifdef MFD_CLOEXEC
+    int     fd = memfd_create("pg", MFD_CLOEXEC);
+#else
+    static _Atomic unsigned counter;
+    char    name[64];
+    snprintf(name, sizeof name, "/pg-%ld-%u", (long) getpid(), counter++);
+    int     fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+        shm_unlink(name);
+#endif
+    if (fd >= 0 && ftruncate(fd, size)) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static Canvas *mapshared(int fd, size_t size, bool create) {
+    void    *map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+
+    SharedHeader *header = map;
+    if (!create &&
+        (memcmp(header->magic, SHARED_MAGIC, sizeof SHARED_MAGIC) ||
+         header->width <= 0 ||
+         header->height <= 0 ||
+         header->stride < header->width ||
+         SHARED_HEADER + (size_t) header->stride * header->height * 4 > size))
+    {
+        munmap(map, size);
+        close(fd);
+        return 0;
+    }
+
+    uint32_t    *pixels = (uint32_t*) ((uint8_t*) map + SHARED_HEADER);
+    Canvas      *g = bmp_new(pixels, header->stride, header->width,
+                    header->height);
+    if (!g) {
+        munmap(map, size);
+        close(fd);
+        return 0;
+    }
+    Bitmap      *bmp = (Bitmap*) g;
+    bmp->format = header->format & 3;
+    bmp->ownpixels = true;
+    bmp->shared = new(SharedFrame, header, size, fd);
+    return g;
+}
+
+static void freeshared(SharedFrame *shared) {
+    munmap(shared->header, shared->size);
+    close(shared->fd);
+    free(shared);
+}
+
+Canvas *pgnewshared(int width, int height) {
+    if (width <= 0 || height <= 0)
+        return 0;
+
+    size_t  size = SHARED_HEADER + (size_t) width * height * 4;
+    int     fd = sharedfd(size);
+    if (fd < 0)
+        return 0;
+
+    // A fresh memfd reads as zeros, so only the header needs writing.
+    SharedHeader *header = mmap(0, SHARED_HEADER, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    memcpy(header->magic, SHARED_MAGIC, sizeof SHARED_MAGIC);
+    header->width = width;
+    header->height = height;
+    header->stride = width;
+    header->format = PG_ARGB;
+    munmap(header, SHARED_HEADER);
+    return mapshared(fd, size, true);
+}
+
+// Map a bitmap another process shared. The descriptor is duplicated, so
+// the caller keeps ownership of fd.
+Canvas *pgimportshared(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) || (size_t) st.st_size < SHARED_HEADER)
+        return 0;
+
+    int     dup = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (dup < 0)
+        return 0;
+    return mapshared(dup, st.st_size, false);
+}
+
+// Descriptor to pass to another process; owned by the canvas.
+int pgsharedfd(Canvas *g) {
+    if (!g || g->_ != &bitmapmethods || !((Bitmap*) g)->shared)
+        return -1;
+    return ((Bitmap*) g)->shared->fd;
+}
+
+// Mark the current frame complete, returning its generation.
+unsigned pgpublish(Canvas *g) {
+    if (!g || g->_ != &bitmapmethods || !((Bitmap*) g)->shared)
+        return 0;
+    SharedHeader *header = ((Bitmap*) g)->shared->header;
+    return atomic_fetch_add_explicit(&header->generation, 1,
+            memory_order_release) + 1;
+}
+
+// Latest published generation. The producer may change the pixel format
+// between frames, so an importer picks it up again here.
+unsigned pggeneration(Canvas *g) {
+    if (!g || g->_ != &bitmapmethods || !((Bitmap*) g)->shared)
+        return 0;
+    SharedHeader *header = ((Bitmap*) g)->shared->header;
+    unsigned    generation = atomic_load_explicit(&header->generation,
+                    memory_order_acquire);
+    ((Bitmap*) g)->format = header->format & 3;
+    return generation;
+}
+
+
+/*
+
+    Streaming.
+
+    Very large images are drawn one strip of rows at a time. Each strip
+    is a canvas the size of the whole image whose pixels and clip cover
+    only the strip, so the draw callback works in image co-ordinates and
+    memory is proportional to the strip.
+
+*/
+
+
+bool pgstream(
+    int         width,
+    int         height,
+    int         rows,
+    void        (*draw)(Canvas *g, void *data),
+    bool        (*sink)(const uint32_t *pixels, int width, int height,
+                    int y, void *data),
+    void        *data)
+{
+    if (width <= 0 || height <= 0 || rows <= 0)
+        return false;
+
+    rows = rows < height? rows: height;
+    uint32_t    *strip = malloc((size_t) width * rows * sizeof *strip);
+    bool        ok = strip != 0;
+
+    for (int y = 0; ok && y < height; y += rows) {
+        int     n = height - y < rows? height - y: rows;
+        memset(strip, 0, (size_t) width * n * sizeof *strip);
+
+        Canvas  *g = bmp_new(strip, width, width, height);
+        if (!g) {
+            ok = false;
+            break;
+        }
+        ((Bitmap*) g)->top = y;
+        g->clip = (Rect) {{ 0, y, width, y + n }};
+        draw(g, data);
+        pgfree(g);
+        ok = sink(strip, width, n, y, data);
+    }
+    free(strip);
+    return ok;
+}
+
+
+/*
+
+    Image Files.
+
+    Bitmaps, or rows delivered a strip at a time, are written as binary
+    PPM or PNG. PNG data is deflated here without zlib: either stored, or
+    as fixed-code blocks with a greedy single-probe LZ77 search, which on
+    Up-filtered interface and chart images is mostly runs of zeros.
+
+*/
+
+
+struct ImageWriter {
+    FILE        *file;
+    int         type;
+    int         width;
+    int         height;
+    int         y;
+    uint8_t     *row;       // Filter byte then the converted row.
+    uint8_t     *prev;      // Previous row, for the Up filter.
+    bool        ok;
+
+    uint8_t     *win;       // Deflate history and pending input.
+    size_t      base;       // Stream position of win[0].
+    size_t      pos;        // Next position to compress.
+    size_t      end;        // Stream position after the last input.
+    size_t      *head;      // Last position + 1 of each 3-byte hash.
+    uint64_t    bits;
+    int         nbits;
+    uint32_t    adler;
+    uint8_t     *out;       // Compressed bytes for the next IDAT chunk.
+    size_t      nout;
+};
+
+static uint32_t crctable[8][256];   // Slicing by eight.
+static uint16_t fixedcode[288];     // Bit-reversed fixed literal codes.
+static uint8_t  fixedlen[288];
+static uint8_t  lencode[259];       // Length symbol - 257 for each length.
+static uint8_t  distcode[512];      // As zlib: by d - 1, then (d - 1) >> 7.
+static const uint16_t lenbase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lenextra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distbase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+    16385, 24577 };
+static const uint8_t distextra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static pthread_once_t deflateonce = PTHREAD_ONCE_INIT;
+
+static unsigned reversebits(unsigned code, int n) {
+    unsigned    r = 0;
+    for (int i = 0; i < n; i++)
+        r |= (code >> i & 1) << (n - 1 - i);
+    return r;
+}
+
+static void initdeflate(void) {
+    for (unsigned i = 0; i < 256; i++) {
+        uint32_t    c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1? 0xedb88320 ^ (c >> 1): c >> 1;
+        crctable[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+        for (int k = 1; k < 8; k++)
+            crctable[k][i] = crctable[0][crctable[k - 1][i] & 255] ^
+                             (crctable[k - 1][i] >> 8);
+    for (int i = 0; i < 288; i++) {
+        int     n = i < 144? 8: i < 256? 9: i < 280? 7: 8;
+        int     code = i < 144? 0x30 + i:
+                       i < 256? 0x190 + i - 144:
+                       i < 280? i - 256:
+                       0xc0 + i - 280;
+        fixedcode[i] = reversebits(code, n);
+        fixedlen[i] = n;
+    }
+    for (int c = 0; c < 29; c++)
+        for (int n = 0; n < 1 << lenextra[c] && lenbase[c] + n < 259; n++)
+            lencode[lenbase[c] + n] = c;
+    lencode[258] = 28;
+    for (int c = 0; c < 30; c++)
+        for (int n = 0; n < 1 << distextra[c]; n++) {
+            int     d = distbase[c] + n;
+            if (d <= 256)
+                distcode[d - 1] = c;
+            else
+                distcode[256 + ((d - 1) >> 7)] = c;
+        }
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t n) {
+    crc = ~crc;
+    for ( ; n >= 8; n -= 8, data += 8) {
+        uint32_t    lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 |
+                        (uint32_t) data[3] << 24);
+        crc = crctable[7][lo & 255] ^
+              crctable[6][lo >> 8 & 255] ^
+              crctable[5][lo >> 16 & 255] ^
+              crctable[4][lo >> 24] ^
+              crctable[3][data[4]] ^
+              crctable[2][data[5]] ^
+              crctable[1][data[6]] ^
+              crctable[0][data[7]];
+    }
+    while (n--)
+        crc = crctable[0][(crc ^ *data++) & 255] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void putbe32(uint8_t *p, uint32_t x) {
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+static void png_chunk(ImageWriter *w, const char *type, const uint8_t *data,
+    size_t n)
+{
+    uint8_t     head[8];
+    uint8_t     tail[4];
+    putbe32(head, n);
+    memcpy(head + 4, type, 4);
+    putbe32(tail, crc32(crc32(0, head + 4, 4), data, n));
+    w->ok = w->ok &&
+            fwrite(head, 1, 8, w->file) == 8 &&
+            fwrite(data, 1, n, w->file) == n &&
+            fwrite(tail, 1, 4, w->file) == 4;
+}
+
+static void z_flush(ImageWriter *w) {
+    if (w->nout)
+        png_chunk(w, "IDAT", w->out, w->nout);
+    w->nout = 0;
+}
+
+static inline void z_put(ImageWriter *w, unsigned code, int n) {
+    w->bits |= (uint64_t) code << w->nbits;
+    w->nbits += n;
+    while (w->nbits >= 8) {
+        w->out[w->nout++] = w->bits;
+        w->bits >>= 8;
+        w->nbits -= 8;
+        if (w->nout == IDAT_SIZE)
+            z_flush(w);
+    }
+}
+
+static void z_align(ImageWriter *w) {
+    if (w->nbits)
+        z_put(w, 0, 8 - w->nbits);
+}
+
+// Copy bytes after z_align().
+static void z_bytes(ImageWriter *w, const uint8_t *data, size_t n) {
+    while (n) {
+        size_t  k = IDAT_SIZE - w->nout < n? IDAT_SIZE - w->nout: n;
+        memcpy(w->out + w->nout, data, k);
+        w->nout += k;
+        data += k;
+        n -= k;
+        if (w->nout == IDAT_SIZE)
+            z_flush(w);
+    }
+}
+
+static inline void z_literal(ImageWriter *w, int c) {
+    z_put(w, fixedcode[c], fixedlen[c]);
+}
+
+static inline void z_match(ImageWriter *w, int len, int dist) {
+    int     lc = lencode[len];
+    int     dc = distcode[dist <= 256? dist - 1: 256 + ((dist - 1) >> 7)];
+    z_literal(w, 257 + lc);
+    z_put(w, len - lenbase[lc], lenextra[lc]);
+    z_put(w, reversebits(dc, 5), 5);
+    z_put(w, dist - distbase[dc], distextra[dc]);
+}
+
+// Compress pending input. Unless finishing, keep a full match of lookahead.
+static void z_compress(ImageWriter *w, bool final) {
+    size_t      stop = final || w->type == PG_PNG_STORE
+                    ? w->end
+                    : w->end > w->pos + 258? w->end - 258: w->pos;
+    uint8_t     *win = w->win - w->base;    // Indexed by stream position.
+
+    if (stop <= w->pos)
+        return;
+
+    if (w->type == PG_PNG_STORE) {
+        for ( ; w->pos < stop; ) {
+            size_t  n = stop - w->pos < 65535? stop - w->pos: 65535;
+            z_put(w, 0, 3);
+            z_align(w);
+            z_put(w, n, 16);
+            z_put(w, n ^ 0xffff, 16);
+            z_bytes(w, win + w->pos, n);
+            w->pos += n;
+        }
+        return;
+    }
+
+    size_t      p = w->pos;
+    z_put(w, 2, 3);                         // Not final, fixed codes.
+    while (p < stop) {
+        if (w->end - p < 3) {
+            z_literal(w, win[p++]);
+            continue;
+        }
+
+        uint32_t    key = win[p] | win[p + 1] << 8 | win[p + 2] << 16;
+        uint32_t    h = key * 2654435761u >> (32 - ZHASH_BITS);
+        size_t      cand = w->head[h];
+        int         len = 0;
+        w->head[h] = p + 1;
+
+        if (cand-- && cand >= w->base && p - cand <= ZWINDOW) {
+            int     max = w->end - p < 258? w->end - p: 258;
+            while (len < max && win[cand + len] == win[p + len])
+                len++;
+        }
+        if (len >= 3) {
+            z_match(w, len, p - cand);
+            p += len;
+        } else
+            z_literal(w, win[p++]);
+    }
+    w->pos = p;
+    z_literal(w, 256);
+}
+
+static void z_feed(ImageWriter *w, const uint8_t *data, size_t n) {
+    uint32_t    a = w->adler & 0xffff;
+    uint32_t    b = w->adler >> 16;
+    for (size_t i = 0; i < n; ) {
+        size_t  k = n - i < 5552? n - i: 5552;
+        for (size_t j = 0; j < k; j++) {
+            a += data[i + j];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        i += k;
+    }
+    w->adler = b << 16 | a;
+
+    while (n) {
+        size_t  room = ZBUFFER - (w->end - w->base);
+        if (room == 0) {
+            z_compress(w, false);
+
+            // Slide the window down to the history still in reach.
+            size_t  keep = w->pos - w->base > ZWINDOW? w->pos - ZWINDOW: w->base;
+            memmove(w->win, w->win + (keep - w->base), w->end - keep);
+            w->base = keep;
+            continue;
+        }
+        size_t  k = n < room? n: room;
+        memcpy(w->win + (w->end - w->base), data, k);
+        w->end += k;
+        data += k;
+        n -= k;
+    }
+}
+
+ImageWriter *pgopenimage(const char *file, int type, int width, int height) {
+    if (width <= 0 || height <= 0 || type < PG_PPM || type > PG_PNG_STORE)
+        return 0;
+
+    pthread_once(&deflateonce, initdeflate);
+    ImageWriter *w = new(ImageWriter,
+                    .file = fopen(file, "wb"),
+                    .type = type,
+                    .width = width,
+                    .height = height,
+                    .row = malloc((size_t) width * 4 + 16),
+                    .prev = calloc((size_t) width * 4 + 16, 1),
+                    .ok = true,
+                    .adler = 1);
+    if (type != PG_PPM) {
+        w->win = malloc(ZBUFFER);
+        w->head = calloc(1 << ZHASH_BITS, sizeof *w->head);
+        w->out = malloc(IDAT_SIZE);
+    }
+    if (!w->file ||
+        !w->row ||
+        !w->prev ||
+        (type != PG_PPM && (!w->win || !w->head || !w->out)))
+    {
+        w->ok = false;
+        pgcloseimage(w);
+        return 0;
+    }
+    setvbuf(w->file, 0, _IOFBF, 1 << 20);
+
+    if (type == PG_PPM)
+        w->ok = fprintf(w->file, "P6\n%d %d\n255\n", width, height) > 0;
+    else {
+        uint8_t     ihdr[13] = { 0, 0, 0, 0, 0, 0, 0, 0, 8, 6, 0, 0, 0 };
+        putbe32(ihdr, width);
+        putbe32(ihdr + 4, height);
+        w->ok = fwrite("\x89PNG\r\n\x1a\n", 1, 8, w->file) == 8;
+        png_chunk(w, "IHDR", ihdr, sizeof ihdr);
+        z_put(w, 0x0178, 16);               // Zlib header, 32K window.
+    }
+    return w;
+}
+
+bool pgwriterows(ImageWriter *w, const uint32_t *pixels, int stride, int rows,
+    int format)
+{
+    if (!w || !w->ok || rows > w->height - w->y)
+        return false;
+
+    bool    up = w->type == PG_PNG;
+    for (int y = 0; y < rows; y++, pixels += stride) {
+        uint8_t     *out = w->row + 1;
+
+        // Convert to straight RGBA bytes, applying the Up filter as we go.
+        for (int x = 0; x < w->width; x += 4) {
+            v4u     px = { 0, 0, 0, 0 };
+            int     n = w->width - x < 4? w->width - x: 4;
+            memcpy(&px, pixels + x, n * sizeof *pixels);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            px = convertpx(px, format, PG_ARGB);
+            px = px << 8 | px >> 24;
+#else
+            px = convertpx(px, format, PG_ABGR);
+#endif
+            if (w->type == PG_PPM) {
+                uint8_t     *b = (uint8_t*) &px;
+                for (int i = 0; i < n; i++, out += 3)
+                    memcpy(out, b + i * 4, 3);
+                continue;
+            }
+            if (up) {
+                v16b    c;
+                v16b    p;
+                memcpy(&c, &px, sizeof c);
+                memcpy(&p, w->prev + x * 4, sizeof p);
+                memcpy(w->prev + x * 4, &c, sizeof c);
+                c -= p;
+                memcpy(&px, &c, sizeof px);
+            }
+            memcpy(out, &px, n * 4);
+            out += n * 4;
+        }
+
+        size_t      n = out - (w->row + 1);
+        if (w->type == PG_PPM)
+            w->ok = w->ok && fwrite(w->row + 1, 1, n, w->file) == n;
+        else {
+            w->row[0] = up? 2: 0;           // Up or None.
+            z_feed(w, w->row, n + 1);
+        }
+        w->y++;
+    }
+    return w->ok;
+}
+
+bool pgcloseimage(ImageWriter *w) {
+    if (!w)
+        return false;
+
+    bool    ok = w->ok && w->y == w->height;
+    if (ok && w->type != PG_PPM) {
+        z_compress(w, true);
+        if (w->type == PG_PNG_STORE) {
+            z_put(w, 1, 3);
+            z_align(w);
+            z_put(w, 0, 16);
+            z_put(w, 0xffff, 16);
+        }
+        else
+            z_put(w, 3, 10);                // Empty final fixed block.
+        z_align(w);
+        for (int i = 24; i >= 0; i -= 8)
+            z_put(w, w->adler >> i & 255, 8);
+        z_flush(w);
+        png_chunk(w, "IEND", 0, 0);
+        ok = w->ok;
+    }
+    if (w->file)
+        ok = fclose(w->file) == 0 && ok;
+    free(w->row);
+    free(w->prev);
+    free(w->win);
+    free(w->head);
+    free(w->out);
+    free(w);
+    return ok;
+}
+
+// A pgstream() sink writing each strip to an ImageWriter.
+bool pgimagesink(const uint32_t *pixels, int width, int height, int y,
+    void *writer)
+{
+    (void) y;
+    return pgwriterows(writer, pixels, width, height, PG_ARGB);
+}
+
+bool pgsaveimage(Canvas *g, const char *file, int type) {
+    if (!g || g->_ != &bitmapmethods)
+        return false;
+
+    Bitmap      *bmp = (Bitmap*) g;
+    ImageWriter *w = pgopenimage(file, type, g->width, g->height);
+    pgwriterows(w, bmprow(bmp, 0), bmp->stride, g->height, bmp->format);
+    return pgcloseimage(w);
+}
+
+
+/*
+
+    Path Recording Canvas.
+
+*/
+
+
+typedef struct {
+    Canvas      g;
+    Path        *path;
+} Recorder;
+
+static void rec_free(Canvas *g) {
+    (void) g;
+}
+
+static Canvas *rec_subcanvas(Canvas *g, int ax, int ay, int bx, int by) {
+    (void) g;
+    (void) ax;
+    (void) ay;
+    (void) bx;
+    (void) by;
+    return 0;
+}
+
+static void rec_setctm(Canvas *g, CTM ctm) {
+    (void) g;
+    (void) ctm;
+}
+
+static void rec_clear(Canvas *g, Colour colour) {
+    (void) g;
+    (void) colour;
+}
+
+static void rec_clean(Canvas *g) {
+    pgpclean(((Recorder*) g)->path);
+}
+
+static void rec_close(Canvas *g) {
+    pgpclose(((Recorder*) g)->path);
+}
+
+static void rec_move(Canvas *g, Point a) {
+    pgpmove(((Recorder*) g)->path, a);
+}
+
+static void rec_line(Canvas *g, Point b) {
+    pgpline(((Recorder*) g)->path, b);
+}
+
+static void rec_curve3(Canvas *g, Point b, Point c) {
+    pgpcurve3(((Recorder*) g)->path, b, c);
+}
+
+static void rec_curve4(Canvas *g, Point b, Point c, Point d) {
+    pgpcurve4(((Recorder*) g)->path, b, c, d);
+}
+
+static void rec_fill(Canvas *g, Colour colour) {
+    (void) g;
+    (void) colour;
+}
+
+static void rec_stroke(Canvas *g, float stroke, Colour colour) {
+    (void) g;
+    (void) stroke;
+    (void) colour;
+}
+
+static void rec_strokefill(Canvas *g, float stroke, Colour cs, Colour cf) {
+    (void) g;
+    (void) stroke;
+    (void) cs;
+    (void) cf;
+}
+
+static void rec_sdf(Canvas *g, const SdfGlyph *sdf, CTM ctm, Colour colour) {
+    (void) g;
+    (void) sdf;
+    (void) ctm;
+    (void) colour;
+}
+
+static void rec_fillpaint(Canvas *g, const Paint *paint) {
+    (void) g;
+    (void) paint;
+}
+
+static void rec_blit(
+    Canvas      *g,
+    Canvas      *src,
+    IntRect     sr,
+    IntRect     dr,
+    int         filter)
+{
+    (void) g;
+    (void) src;
+    (void) sr;
+    (void) dr;
+    (void) filter;
+}
+
+static void rec_origin(Canvas *g, int dx, int dy) {
+    (void) g;
+    (void) dx;
+    (void) dy;
+}
+
+static void rec_fillcompiled(Canvas *g, CompiledPath *cp, const Paint *paint) {
+    (void) g;
+    (void) cp;
+    (void) paint;
+}
+
+static void rec_fillmask(Canvas *g, Canvas *mask, int x, int y, Colour colour)
+{
+    (void) g;
+    (void) mask;
+    (void) x;
+    (void) y;
+    (void) colour;
+}
+
+static const CanvasMethods recordermethods = {
+    rec_free,
+    rec_subcanvas,
+    rec_setctm,
+    rec_clear,
+    rec_clean,
+    rec_close,
+    rec_move,
+    rec_line,
+    rec_curve3,
+    rec_curve4,
+    rec_fill,
+    rec_stroke,
+    rec_strokefill,
+    rec_sdf,
+    rec_fillpaint,
+    rec_blit,
+    rec_origin,
+    rec_fillcompiled,
+    rec_fillmask,
+};
+
+// Canvas that appends everything drawn to it onto path.
+static inline Recorder initrecorder(Path *path) {
+    return (Recorder) {
+        {
+            &recordermethods,
+            0,
+            0,
+            {{ 0, 0, 0, 0 }},
+            { 1, 0, 0, 1, 0, 0 },
+            false,
+            PG_AUTO,
+            false,
+            PG_NONZERO,
+            0,
+            0,
+            0,
+            {{ 0 }},
+        },
+        path,
+    };
+}
+
+/*
+
+    Fonts.
+
+*/
+
+
+static Font *otf_openfont(void * restrict data, size_t size, int index);
+static Font *cf_openfont(void * restrict data, size_t size);
+
+typedef struct {
+    pthread_t   thread;
+    Font        *font;
+    bool        sdf;
+    char        chars[];
+} Warmup;
+
+static void freesdf(SdfGlyph *sdf) {
+    if (sdf) {
+        free(sdf->data);
+        free(sdf);
+    }
+}
+
+Font *pgfontfile(const char *file, int index) {
+    struct stat stat;
+    int         fd = open(file, O_RDONLY);
+    int         err = fstat(fd, &stat);
+    if (fd < 0 || err)
+        return 0;
+
+    void *data = mmap(0, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+
+    Font *font = cf_openfont(data, stat.st_size);
+    if (!font)
+        font = otf_openfont(data, stat.st_size, index);
+    if (!font)
+        munmap(data, stat.st_size);
+    return font;
+}
+
+void pgfreefont(Font *font) {
+    if (font) {
+        pgwaitfont(font);
+        if (font->sdf)
+            for (unsigned i = 0; i < font->nglyphs; i++)
+                freesdf(font->sdf[i]);
+        free(font->sdf);
+        font->_->free(font);
+        munmap(font->data, font->datasize);
+    }
+}
+
+Font *pgfontctm(Font *font, CTM ctm) {
+    if (font) {
+        font->_->setctm(font, ctm);
+        font->ctm = ctm;
+    }
     return font;
 }
 
@@ -861,9 +3792,7 @@ Point pgglyphadvance(Font *font, Point p, unsigned glyph) {
     if (!font || glyph >= font->nglyphs)
         return p;
 
-    OpenTypeFont    *otf = (OpenTypeFont*) font;
-    int             index = glyph >= otf->nhmetrics? otf->nhmetrics - 1: glyph;
-    float           adv = pkw(otf->hmtx + index * 4);
+    float           adv = font->_->advance(font, glyph);
     Point           d = pgapplyctm(font->ctm, pt(adv, 0));
     return pt(p.x + d.x, p.y + d.y);
 }
@@ -879,8 +3808,298 @@ Point pgmeasure(Font *font, const char *text) {
     for (uint8_t *s = (uint8_t*) text; *s; )
         p = pgcharadvance(font, p, pgfromutf8(&s));
 
-    Point   vert = pgapplyctm(font->ctm, pt(0, font->em));
-    return pt(p.x + vert.x, p.y + vert.y);
+    Point   vert = pgapplyctm(font->ctm, pt(0, font->em));
+    return pt(p.x + vert.x, p.y + vert.y);
+}
+
+
+/*
+
+    Signed Distance Field Glyphs.
+
+*/
+
+
+static uint8_t *otf_glyphdata(OpenTypeFont *otf, unsigned glyph);
+
+// Font units to canvas co-ordinates for a glyph drawn at p.
+static CTM glyphctm(Font *font, Point p) {
+    CTM         ctm = {1, 0, 0, -1, 0, font->ascent };
+    ctm = pgmulctm(ctm, font->ctm);
+    ctm.e += p.x;       // Canvas co-ordinates; not scaled.
+    ctm.f += p.y;       // Canvas co-ordinates; not scaled.
+    return ctm;
+}
+
+// Squared distance from p to the line segment a-b.
+static float segdistance2(Point p, Point a, Point b) {
+    float   dx = b.x - a.x;
+    float   dy = b.y - a.y;
+    float   len = dx * dx + dy * dy;
+    float   t = len? clamp(0, ((p.x - a.x) * dx + (p.y - a.y) * dy) / len, 1): 0;
+    float   ex = p.x - (a.x + dx * t);
+    float   ey = p.y - (a.y + dy * t);
+    return ex * ex + ey * ey;
+}
+
+// Flatten path into a list of line segments (pairs of points).
+static int flattenpath(Path *path, Point **out, int lim) {
+    Point   tmp[1 << BEZ_LIMIT];
+    Point   cur = {0, 0};
+    int     n = 0;
+    int     cap = 0;
+    int     nseg;
+
+    *out = 0;
+    for (int i = 0; i < path->np; cur = path->pts[i - 1]) {
+        switch (path->shapes[i]) {
+        case 0: // Move.
+            i++;
+            continue;
+        case 1: // Line.
+            tmp[0] = path->pts[i];
+            nseg = 1;
+            i++;
+            break;
+        case 2: // Curve3
+            nseg = flatten3(tmp, cur, path->pts[i], path->pts[i + 1], lim);
+            i += 2;
+            break;
+        default: // Curve4
+            nseg = flatten4(tmp, cur, path->pts[i], path->pts[i + 1],
+                path->pts[i + 2], lim);
+            i += 3;
+            break;
+        }
+
+        if (n + nseg * 2 > cap) {
+            cap = (n + nseg * 2) * 2;
+            *out = realloc(*out, cap * sizeof **out);
+        }
+        for (int j = 0; j < nseg; j++) {
+            (*out)[n++] = cur;
+            (*out)[n++] = cur = tmp[j];
+        }
+    }
+    return n / 2;
+}
+
+static SdfGlyph *makesdf(Font *font, unsigned glyph) {
+    Path        *path = pgpath(0);
+    Recorder    rec = initrecorder(path);
+    CTM         identity = { 1, 0, 0, 1, 0, 0 };
+    font->_->outline(&rec.g, font, identity, glyph);
+
+    // Control points bound the outline.
+    float       xmin = path->np? INFINITY: 0;
+    float       ymin = path->np? INFINITY: 0;
+    float       xmax = path->np? -INFINITY: 0;
+    float       ymax = path->np? -INFINITY: 0;
+    for (int i = 0; i < path->np; i++) {
+        xmin = fminf(xmin, path->pts[i].x);
+        ymin = fminf(ymin, path->pts[i].y);
+        xmax = fmaxf(xmax, path->pts[i].x);
+        ymax = fmaxf(ymax, path->pts[i].y);
+    }
+
+    // Move the outline into texel space.
+    float       s = SDF_EM / font->em;
+    float       pad = ceilf(SDF_SPREAD * 0.5f) + 1;
+    int         width = ceilf((xmax - xmin) * s + pad * 2);
+    int         height = ceilf((ymax - ymin) * s + pad * 2);
+    CTM         ctm = { s, 0, 0, -s, pad - xmin * s, pad + ymax * s };
+    for (int i = 0; i < path->np; i++)
+        path->pts[i] = pgapplyctm(ctm, path->pts[i]);
+
+    Point       *seg;
+    int         nseg = flattenpath(path, &seg, SDF_BEZ_LIMIT);
+    uint8_t     *texels = malloc(width * height);
+
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++) {
+            Point   p = pt(x + 0.5f, y + 0.5f);
+            float   d2 = SDF_SPREAD * SDF_SPREAD;
+            int     winding = 0;
+
+            for (int i = 0; i < nseg; i++) {
+                Point   a = seg[i * 2];
+                Point   b = seg[i * 2 + 1];
+                float   cross = (b.x - a.x) * (p.y - a.y) -
+                                (p.x - a.x) * (b.y - a.y);
+
+                if (a.y <= p.y && p.y < b.y && cross > 0)
+                    winding++;
+                else if (b.y <= p.y && p.y < a.y && cross < 0)
+                    winding--;
+                d2 = fminf(d2, segdistance2(p, a, b));
+            }
+
+            float   sd = winding? sqrtf(d2): -sqrtf(d2);
+            texels[y * width + x] =
+                roundf(127.5f + clamp(-1, sd / SDF_SPREAD, 1) * 127.5f);
+        }
+
+    free(seg);
+    pgfreepath(path);
+
+    return new(SdfGlyph,
+        width,
+        height,
+        SDF_SPREAD * 2,
+        pginvertctm(ctm),
+        texels);
+}
+
+SdfGlyph *pgglyphsdf(Font *font, unsigned glyph) {
+    if (!font || glyph >= font->nglyphs)
+        return 0;
+
+    // The cache may be filled concurrently by pgwarmfont().
+    // Whoever loses a race frees their copy.
+    SdfGlyph    **cache = __atomic_load_n(&font->sdf, __ATOMIC_ACQUIRE);
+    if (!cache) {
+        SdfGlyph    **fresh = calloc(font->nglyphs, sizeof *fresh);
+        if (__atomic_compare_exchange_n(&font->sdf, &cache, fresh, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            cache = fresh;
+        else
+            free(fresh);
+    }
+
+    SdfGlyph    *sdf = __atomic_load_n(&cache[glyph], __ATOMIC_ACQUIRE);
+    if (!sdf) {
+        SdfGlyph    *fresh = makesdf(font, glyph);
+        if (__atomic_compare_exchange_n(&cache[glyph], &sdf, fresh, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            sdf = fresh;
+        else
+            freesdf(fresh);
+    }
+    return sdf;
+}
+
+Point pgsdfglyph(Canvas *g, Font *font, Point p, unsigned glyph, Colour colour) {
+    SdfGlyph    *sdf = g? pgglyphsdf(font, glyph): 0;
+    if (sdf) {
+        CTM     ctm = pgmulctm(sdf->ctm, glyphctm(font, p));
+        g->_->sdf(g, sdf, ctm, colour);
+        return pgglyphadvance(font, p, glyph);
+    }
+    return p;
+}
+
+Point pgsdfchar(Canvas *g, Font *font, Point p, unsigned c, Colour colour) {
+    if (g && font && c < 65536)
+        return pgsdfglyph(g, font, p, font->mapping[c & 0xffff], colour);
+    return p;
+}
+
+Point pgsdfstring(Canvas *g, Font *font, Point p, const char *str,
+    Colour colour)
+{
+    if (g && font && str) {
+        for (uint8_t *s = (uint8_t*) str; *s; )
+            p = pgsdfchar(g, font, p, pgfromutf8(&s), colour);
+    }
+    return p;
+}
+
+
+/*
+
+    Font Warm-up.
+
+*/
+
+
+// Ask the kernel to start reading a mapped range in.
+static void prefetch(const void *ptr, size_t size) {
+    uintptr_t   page = sysconf(_SC_PAGESIZE);
+    uintptr_t   a = (uintptr_t) ptr & ~(page - 1);
+    uintptr_t   b = (uintptr_t) ptr + size;
+    if (ptr && size)
+        madvise((void*) a, b - a, MADV_WILLNEED);
+}
+
+static const FontMethods otfmethods;
+
+static void *warmcompiled(Warmup *w) {
+    prefetch(w->font->data, w->font->datasize);
+    for (uint8_t *s = (uint8_t*) w->chars; w->sdf && *s; ) {
+        unsigned    c = pgfromutf8(&s);
+        pgglyphsdf(w->font, w->font->mapping[c & 0xffff]);
+    }
+    return 0;
+}
+
+static void *warmfont(void *arg) {
+    Warmup          *w = arg;
+    if (w->font->_ != &otfmethods)
+        return warmcompiled(w);
+
+    OpenTypeFont    *otf = (OpenTypeFont*) w->font;
+    unsigned        nglyphs = otf->f.nglyphs;
+    size_t          locasize = (nglyphs + 1) * (otf->longloca? 4: 2);
+    size_t          glyfsize = otf->longloca
+                                ? pkd(otf->loca + nglyphs * 4)
+                                : pkw(otf->loca + nglyphs * 2) * 2;
+    size_t          hmtxsize = otf->nhmetrics * 4 +
+                                (nglyphs - otf->nhmetrics) * 2;
+
+    prefetch(otf->loca, locasize);
+    prefetch(otf->hmtx, hmtxsize);
+    prefetch(otf->glyf, glyfsize);
+
+    // Fault in the glyphs that will be drawn first.
+    volatile uint8_t sink = 0;
+    for (uint8_t *s = (uint8_t*) w->chars; *s; ) {
+        unsigned    c = pgfromutf8(&s);
+        unsigned    glyph = otf->f.mapping[c & 0xffff];
+        unsigned    index = glyph >= otf->nhmetrics? otf->nhmetrics - 1: glyph;
+        uint8_t     *data = otf_glyphdata(otf, glyph);
+
+        sink += pkw(otf->hmtx + index * 4);
+        if (data)
+            sink += *data;
+        if (w->sdf)
+            pgglyphsdf(w->font, glyph);
+    }
+    (void) sink;
+    return 0;
+}
+
+// Start reading the font's glyph data in on a background thread.  Outlines
+// are not cached, so with sdf false this is only a readahead hint that
+// takes page faults off the first draw; with sdf true it also builds the
+// distance fields for chars.
+Font *pgwarmfont(Font *font, const char *chars, bool sdf) {
+    if (font) {
+        pgwaitfont(font);
+
+        if (!chars)
+            chars = "";
+        size_t  len = strlen(chars) + 1;
+        Warmup  *w = malloc(sizeof *w + len);
+        w->font = font;
+        w->sdf = sdf;
+        memcpy(w->chars, chars, len);
+
+        if (pthread_create(&w->thread, 0, warmfont, w) == 0)
+            font->warmup = w;
+        else
+            free(w);
+    }
+    return font;
+}
+
+Font *pgwaitfont(Font *font) {
+    if (font && font->warmup) {
+        Warmup  *w = font->warmup;
+        pthread_join(w->thread, 0);
+        free(w);
+        font->warmup = 0;
+    }
+    return font;
 }
 
 
@@ -902,24 +4121,23 @@ void otf_setcm(Font *font, CTM ctm) {
     (void) ctm;
 }
 
-void otf_glyph(Canvas *g, Font *font, Point p, unsigned glyph) {
-    OpenTypeFont    *otf = (OpenTypeFont*) font;
-
-    CTM         ctm = {1, 0, 0, -1, 0, font->ascent };
-    ctm = pgmulctm(ctm, font->ctm);
-    ctm.e += p.x;       // Canvas co-ordinates; not scaled.
-    ctm.f += p.y;       // Canvas co-ordinates; not scaled.
-
+static uint8_t *otf_glyphdata(OpenTypeFont *otf, unsigned glyph) {
     unsigned    offset = otf->longloca
                         ? pkd(otf->loca + glyph * 4)
                         : pkw(otf->loca + glyph * 2) * 2;
     unsigned    next =  otf->longloca
                         ? pkd(otf->loca + (glyph + 1) * 4)
                         : pkw(otf->loca + (glyph + 1) * 2) * 2;
-    uint8_t * restrict ptr = otf->glyf + offset;
-    int         ncontours = offset == next
-                        ? 0
-                        : (int16_t) pkw(ptr);
+    return offset == next? 0: (uint8_t*) otf->glyf + offset;
+}
+
+static void otf_outline(Canvas *g, Font *font, CTM ctm, unsigned glyph) {
+    OpenTypeFont    *otf = (OpenTypeFont*) font;
+    uint8_t * restrict ptr = otf_glyphdata(otf, glyph);
+    if (!ptr)
+        return;
+
+    int         ncontours = (int16_t) pkw(ptr);
     ptr += 10;
 
     if (ncontours == 0) {
@@ -1011,10 +4229,22 @@ void otf_glyph(Canvas *g, Font *font, Point p, unsigned glyph) {
 
 }
 
+void otf_glyph(Canvas *g, Font *font, Point p, unsigned glyph) {
+    otf_outline(g, font, glyphctm(font, p), glyph);
+}
+
+static float otf_advance(Font *font, unsigned glyph) {
+    OpenTypeFont    *otf = (OpenTypeFont*) font;
+    int             index = glyph >= otf->nhmetrics? otf->nhmetrics - 1: glyph;
+    return pkw(otf->hmtx + index * 4);
+}
+
 static const FontMethods otfmethods = {
     otf_free,
     otf_setcm,
     otf_glyph,
+    otf_outline,
+    otf_advance,
 };
 
 static Font *otf_openfont(void * restrict data, size_t size, int index) {
@@ -1192,6 +4422,8 @@ static Font *otf_openfont(void * restrict data, size_t size, int index) {
             descent,
             nglyphs,
             mapping,
+            0,
+            0,
         },
         cmap,
         glyf,
@@ -1205,6 +4437,245 @@ fail:
 }
 
 
+/*
+
+    Compiled Fonts.
+
+    Outlines are decoded ahead of time into font units and stored as
+    structure-of-arrays with the advances and character mapping, so the
+    file can be mapped and used directly. Values are in host byte order.
+
+*/
+
+
+#define CF_MAGIC "pgfont1"
+#define CF_ALIGN 16
+
+typedef struct {
+    char        magic[8];
+    uint32_t    byteorder;
+    uint32_t    nglyphs;
+    uint32_t    npoints;
+    float       em;
+    float       ascent;
+    float       descent;
+
+    // Byte offsets of the arrays.
+    uint32_t    mapping;    // uint16_t[65536]
+    uint32_t    advance;    // float[nglyphs]
+    uint32_t    start;      // uint32_t[nglyphs + 1]; first point of glyph.
+    uint32_t    xs;         // float[npoints]
+    uint32_t    ys;         // float[npoints]
+    uint32_t    shapes;     // uint8_t[npoints]; as Path.
+} CompiledHeader;
+
+static void cf_free(Font *font) {
+    (void) font;
+}
+
+static void cf_setctm(Font *font, CTM ctm) {
+    (void) font;
+    (void) ctm;
+}
+
+// Glyphs are checked as they are drawn rather than when the font is opened,
+// so opening a font touches only its header.
+static bool cf_validglyph(CompiledFont *cf, unsigned glyph) {
+    uint32_t    from = cf->start[glyph];
+    uint32_t    to = cf->start[glyph + 1];
+    if (from > to || to > cf->npoints)
+        return false;
+
+    // Every segment's points must stay inside its glyph.
+    for (uint32_t i = from; i < to; ) {
+        if (cf->shapes[i] > 3)
+            return false;
+        i += cf->shapes[i] < 2? 1: cf->shapes[i];
+        if (i > to)
+            return false;
+    }
+    return true;
+}
+
+static void cf_outline(Canvas *g, Font *font, CTM ctm, unsigned glyph) {
+    CompiledFont    *cf = (CompiledFont*) font;
+    const float * restrict xs = cf->xs;
+    const float * restrict ys = cf->ys;
+    if (!cf_validglyph(cf, glyph))
+        return;
+
+    for (unsigned i = cf->start[glyph]; i < cf->start[glyph + 1]; )
+        switch (cf->shapes[i]) {
+        case 0: // Move.
+            pgmove(g, pgapplyctm(ctm, pt(xs[i], ys[i])));
+            i++;
+            break;
+        case 1: // Line.
+            pgline(g, pgapplyctm(ctm, pt(xs[i], ys[i])));
+            i++;
+            break;
+        case 2: // Curve3
+            pgcurve3(g,
+                pgapplyctm(ctm, pt(xs[i], ys[i])),
+                pgapplyctm(ctm, pt(xs[i + 1], ys[i + 1])));
+            i += 2;
+            break;
+        default: // Curve4
+            pgcurve4(g,
+                pgapplyctm(ctm, pt(xs[i], ys[i])),
+                pgapplyctm(ctm, pt(xs[i + 1], ys[i + 1])),
+                pgapplyctm(ctm, pt(xs[i + 2], ys[i + 2])));
+            i += 3;
+            break;
+        }
+}
+
+static void cf_glyph(Canvas *g, Font *font, Point p, unsigned glyph) {
+    cf_outline(g, font, glyphctm(font, p), glyph);
+}
+
+static float cf_advance(Font *font, unsigned glyph) {
+    return ((CompiledFont*) font)->advance[glyph];
+}
+
+static const FontMethods cfmethods = {
+    cf_free,
+    cf_setctm,
+    cf_glyph,
+    cf_outline,
+    cf_advance,
+};
+
+static bool cf_inside(size_t size, uint32_t offset, size_t n, size_t unit) {
+    return offset % 4 == 0 && offset <= size && n <= (size - offset) / unit;
+}
+
+static Font *cf_openfont(void * restrict data, size_t size) {
+    CompiledHeader  *h = data;
+
+    if (size < sizeof *h || memcmp(h->magic, CF_MAGIC, sizeof h->magic))
+        return 0;
+
+    bool    valid =
+            h->byteorder == 0x01020304 &&
+            h->nglyphs > 0 &&
+            h->nglyphs < 65536 &&
+            h->em != 0 &&
+            cf_inside(size, h->mapping, 65536, sizeof(uint16_t)) &&
+            cf_inside(size, h->advance, h->nglyphs, sizeof(float)) &&
+            cf_inside(size, h->start, h->nglyphs + 1, sizeof(uint32_t)) &&
+            cf_inside(size, h->xs, h->npoints, sizeof(float)) &&
+            cf_inside(size, h->ys, h->npoints, sizeof(float)) &&
+            cf_inside(size, h->shapes, h->npoints, sizeof(uint8_t));
+    if (!valid)
+        return 0;
+
+    // Glyphs are checked by cf_outline(), and glyph numbers from the
+    // mapping by every caller, so nothing past the header is read here.
+    uint8_t     *base = data;
+    return new(CompiledFont,
+        {
+            &cfmethods,
+
+            data,
+            size,
+
+            {1, 0, 0, 1, 0, 0},
+
+            h->em,
+            h->ascent,
+            h->descent,
+            h->nglyphs,
+            (uint16_t*) (base + h->mapping),
+            0,
+            0,
+        },
+        (float*) (base + h->advance),
+        (uint32_t*) (base + h->start),
+        base + h->shapes,
+        (float*) (base + h->xs),
+        (float*) (base + h->ys),
+        h->npoints);
+}
+
+static uint32_t cf_align(uint32_t offset) {
+    return (offset + CF_ALIGN - 1) & ~(CF_ALIGN - 1);
+}
+
+static bool cf_write(FILE *file, uint32_t offset, const void *data, size_t n) {
+    return  fseek(file, offset, SEEK_SET) == 0 &&
+            fwrite(data, 1, n, file) == n;
+}
+
+bool pgsavefont(Font *font, const char *filename) {
+    if (!font || !filename)
+        return false;
+
+    // Decode every outline in font units.
+    Path        *path = pgpath(0);
+    Recorder    rec = initrecorder(path);
+    CTM         identity = { 1, 0, 0, 1, 0, 0 };
+    uint32_t    *start = malloc((font->nglyphs + 1) * sizeof *start);
+    float       *advance = malloc(font->nglyphs * sizeof *advance);
+
+    for (unsigned i = 0; i < font->nglyphs; i++) {
+        start[i] = path->np;
+        advance[i] = font->_->advance(font, i);
+        font->_->outline(&rec.g, font, identity, i);
+        pgpclose(path);
+    }
+    start[font->nglyphs] = path->np;
+
+    // Only the first point of each segment has a shape in a Path.
+    unsigned    np = path->np;
+    float       *xs = malloc((np + 1) * sizeof *xs);
+    float       *ys = malloc((np + 1) * sizeof *ys);
+    uint8_t     *shapes = calloc(np + 1, 1);
+    for (unsigned i = 0; i < np; i++) {
+        xs[i] = path->pts[i].x;
+        ys[i] = path->pts[i].y;
+    }
+    for (unsigned i = 0; i < np; i += path->shapes[i] < 2? 1: path->shapes[i])
+        shapes[i] = path->shapes[i];
+
+    CompiledHeader  h = {
+        .magic = CF_MAGIC,
+        .byteorder = 0x01020304,
+        .nglyphs = font->nglyphs,
+        .npoints = np,
+        .em = font->em,
+        .ascent = font->ascent,
+        .descent = font->descent,
+    };
+    h.mapping = cf_align(sizeof h);
+    h.advance = cf_align(h.mapping + 65536 * sizeof(uint16_t));
+    h.start = cf_align(h.advance + font->nglyphs * sizeof(float));
+    h.xs = cf_align(h.start + (font->nglyphs + 1) * sizeof(uint32_t));
+    h.ys = cf_align(h.xs + np * sizeof(float));
+    h.shapes = cf_align(h.ys + np * sizeof(float));
+
+    FILE        *file = fopen(filename, "wb");
+    bool        ok = file &&
+        cf_write(file, 0, &h, sizeof h) &&
+        cf_write(file, h.mapping, font->mapping, 65536 * sizeof(uint16_t)) &&
+        cf_write(file, h.advance, advance, font->nglyphs * sizeof(float)) &&
+        cf_write(file, h.start, start, (font->nglyphs + 1) * sizeof(uint32_t)) &&
+        cf_write(file, h.xs, xs, np * sizeof(float)) &&
+        cf_write(file, h.ys, ys, np * sizeof(float)) &&
+        cf_write(file, h.shapes, shapes, np);
+    if (file && fclose(file))
+        ok = false;
+
+    free(start);
+    free(advance);
+    free(xs);
+    free(ys);
+    free(shapes);
+    pgfreepath(path);
+    return ok;
+}
+
+
 /*
 
     Boxes.
@@ -1213,51 +4684,311 @@ fail:
 
 
 static IntRect boxrect(Box *box) {
-    int     x = box->x;
-    int     y = box->y;
-    for (Box *i = box->parent; i; i = i->parent) {
-        x += i->x;
-        y += i->y;
+    return (IntRect) {
+        box->absx,
+        box->absy,
+        box->absx + box->width,
+        box->absy + box->height
+    };
+}
+
+// Take the absolute position from the parent, which must be placed.
+static void placebox(Box *box) {
+    box->absx = box->x + (box->parent? box->parent->absx: 0);
+    box->absy = box->y + (box->parent? box->parent->absy: 0);
+}
+
+static void placetree(Box *box) {
+    placebox(box);
+    for (Box *i = box->children; i; i = i->next)
+        placetree(i);
+}
+
+static void initcontext(Context *ctx) {
+    *ctx = themedefaults;
+    ctx->font = pgfontfile("/usr/share/fonts/TTF/georgia.ttf", 0);
+    pgscalefont(ctx->font, ctx->fontsz, 0);
+}
+
+static void initdefaultcontext(void) {
+    initcontext(&defaultcontext);
+}
+
+Context *pgnewcontext(void) {
+    Context     *ctx = malloc(sizeof *ctx);
+    initcontext(ctx);
+    return ctx;
+}
+
+static void freedrawpool(DrawPool *pool);
+
+void pgfreecontext(Context *ctx) {
+    if (ctx && ctx != &defaultcontext) {
+        freedrawpool(ctx->pool);
+        pgfreefont(ctx->font);
+        free(ctx);
     }
-    return (IntRect) { x, y, x + box->width, y + box->height };
 }
 
-Font *pgthemefont() {
-    if (!themefont) {
-        themefont = pgfontfile("/usr/share/fonts/TTF/georgia.ttf", 0);
-        pgscalefont(themefont, themefontsz, 0);
+// Give a subtree its own context. pgaddbox() passes the parent's context
+// down only to boxes that do not have one yet.
+Box *pgsetcontext(Box *box, Context *ctx) {
+    if (box) {
+        box->context = ctx;
+        for (Box *i = box->children; i; i = i->next)
+            pgsetcontext(i, ctx);
     }
-    return themefont;
+    return box;
+}
+
+// Give boxes without a context their nearest ancestor's.
+static void inheritcontext(Box *box, Context *ctx) {
+    if (!box->context)
+        box->context = ctx;
+    for (Box *i = box->children; i; i = i->next)
+        inheritcontext(i, box->context);
+}
+
+Context *pgboxcontext(Box *box) {
+    if (box && box->context)
+        return box->context;
+    pthread_once(&defaultonce, initdefaultcontext);
+    return &defaultcontext;
+}
+
+Font *pgthemefont() {
+    return pgboxcontext(0)->font;
 }
 
 Colour pgthemefg() {
-    return themefg;
+    return pgboxcontext(0)->fg;
 }
 
 Colour pgthemebg() {
-    return themebg;
+    return pgboxcontext(0)->bg;
 }
 
 Colour pgthemebg2() {
-    return themebg2;
+    return pgboxcontext(0)->bg2;
 }
 
 Colour pgthemeaccent() {
-    return themeaccent;
+    return pgboxcontext(0)->accent;
+}
+
+/*
+
+    Hit-test Index.
+
+    Stacks keep their children in order along one axis, so the child
+    under a point is found by binary search.  Other layouts bucket their
+    children into a uniform grid.  Either way the first child in list
+    order that contains the point wins, as with a linear scan.
+
+*/
+
+struct BoxIndex {
+    int         n;
+    int         axis;       // 0 or 1 when sorted along x or y, else -1.
+    bool        disjoint;   // No two children overlap.
+    Box         **boxes;    // Children in list order.
+    int         cols;
+    int         rows;
+    int         cellw;
+    int         cellh;
+    int         *cells;     // Start of each cell's run in hits.
+    int         *hits;      // Indexes into boxes, ascending within a cell.
+};
+
+static inline bool within(Box *box, int x, int y) {
+    return
+        box->x <= x &&
+        box->y <= y &&
+        x <= box->x + box->width &&
+        y <= box->y + box->height;
+}
+
+static inline bool overlaps(Box *a, Box *b) {
+    return
+        a->x < b->x + b->width && b->x < a->x + a->width &&
+        a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+static inline int boxstart(Box *box, int axis) {
+    return axis? box->y: box->x;
+}
+
+static inline int boxend(Box *box, int axis) {
+    return axis? box->y + box->height: box->x + box->width;
+}
+
+static void freeindex(Box *box) {
+    if (box->index) {
+        free(box->index->boxes);
+        free(box->index->cells);
+        free(box->index->hits);
+        free(box->index);
+        box->index = 0;
+    }
+}
+
+// How many times the children's starts step forward along axis, or -1 if
+// they are not in order.  A column of equal widths is in order along x
+// too, but binary search there finds nothing.
+static int sortedalong(BoxIndex *index, int axis) {
+    int     steps = 0;
+    for (int i = 1; i < index->n; i++) {
+        if (boxstart(index->boxes[i], axis) <
+                boxstart(index->boxes[i - 1], axis) ||
+            boxend(index->boxes[i], axis) <
+                boxend(index->boxes[i - 1], axis))
+            return -1;
+        steps += boxstart(index->boxes[i], axis) >
+                boxstart(index->boxes[i - 1], axis);
+    }
+    return steps;
+}
+
+static void gridcells(BoxIndex *index, Box *box, int *cx, int *cy) {
+    cx[0] = clamp(0, box->x / index->cellw, index->cols - 1);
+    cy[0] = clamp(0, box->y / index->cellh, index->rows - 1);
+    cx[1] = clamp(0, (box->x + box->width) / index->cellw, index->cols - 1);
+    cy[1] = clamp(0, (box->y + box->height) / index->cellh, index->rows - 1);
+}
+
+static void buildgrid(BoxIndex *index, Box *parent) {
+    int     side = ceilf(sqrtf(index->n));
+    if (side > INDEX_GRID)
+        side = INDEX_GRID;
+    index->cols = side;
+    index->rows = side;
+    index->cellw = parent->width / side + 1;
+    index->cellh = parent->height / side + 1;
+    index->cells = calloc(side * side + 1, sizeof *index->cells);
+
+    int     cx[2];
+    int     cy[2];
+    for (int i = 0; i < index->n; i++) {
+        gridcells(index, index->boxes[i], cx, cy);
+        for (int y = cy[0]; y <= cy[1]; y++)
+            for (int x = cx[0]; x <= cx[1]; x++)
+                index->cells[y * side + x + 1]++;
+    }
+    for (int c = 0; c < side * side; c++)
+        index->cells[c + 1] += index->cells[c];
+
+    int     *fill = malloc(side * side * sizeof *fill);
+    memcpy(fill, index->cells, side * side * sizeof *fill);
+    index->hits = malloc(index->cells[side * side] * sizeof *index->hits);
+    for (int i = 0; i < index->n; i++) {
+        gridcells(index, index->boxes[i], cx, cy);
+        for (int y = cy[0]; y <= cy[1]; y++)
+            for (int x = cx[0]; x <= cx[1]; x++)
+                index->hits[fill[y * side + x]++] = i;
+    }
+    free(fill);
+}
+
+// Children that overlap share a grid cell, or along a sorted axis start
+// before the earlier one ends.
+static bool indexdisjoint(BoxIndex *index) {
+    Box     **b = index->boxes;
+    if (index->axis >= 0) {
+        int     axis = index->axis;
+        for (int i = 0; i < index->n; i++)
+            for (int j = i + 1;
+                    j < index->n && boxstart(b[j], axis) < boxend(b[i], axis);
+                    j++)
+                if (overlaps(b[i], b[j]))
+                    return false;
+        return true;
+    }
+
+    int     *hits = index->hits;
+    for (int c = 0; c < index->cols * index->rows; c++)
+        for (int i = index->cells[c]; i < index->cells[c + 1]; i++)
+            for (int j = i + 1; j < index->cells[c + 1]; j++)
+                if (overlaps(b[hits[i]], b[hits[j]]))
+                    return false;
+    return true;
+}
+
+static void indexbox(Box *box) {
+    freeindex(box);
+
+    int     n = 0;
+    for (Box *i = box->children; i; i = i->next)
+        n++;
+    if (n < INDEX_MIN)
+        return;
+
+    BoxIndex    *index = calloc(1, sizeof *index);
+    index->n = n;
+    index->boxes = malloc(n * sizeof *index->boxes);
+    n = 0;
+    for (Box *i = box->children; i; i = i->next)
+        index->boxes[n++] = i;
+
+    int     xsteps = sortedalong(index, 0);
+    int     ysteps = sortedalong(index, 1);
+    index->axis =
+        xsteps <= 0 && ysteps <= 0? -1:
+        xsteps >= ysteps? 0:
+        1;
+    if (index->axis < 0)
+        buildgrid(index, box);
+    index->disjoint = indexdisjoint(index);
+    box->index = index;
+}
+
+// Rebuilt on demand after children are added, removed or moved.
+static BoxIndex *boxindex(Box *box) {
+    if (!box->index)
+        indexbox(box);
+    return box->index;
 }
 
+static Box *indexlocate(BoxIndex *index, int x, int y) {
+    if (index->axis < 0) {
+        int     cx = clamp(0, x / index->cellw, index->cols - 1);
+        int     cy = clamp(0, y / index->cellh, index->rows - 1);
+        int     c = cy * index->cols + cx;
+        for (int i = index->cells[c]; i < index->cells[c + 1]; i++)
+            if (within(index->boxes[index->hits[i]], x, y))
+                return index->boxes[index->hits[i]];
+        return 0;
+    }
+
+    // First child that does not end before the point.
+    int     axis = index->axis;
+    int     v = axis? y: x;
+    int     lo = 0;
+    int     hi = index->n;
+    while (lo < hi) {
+        int     mid = (lo + hi) / 2;
+        if (boxend(index->boxes[mid], axis) < v)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (int i = lo; i < index->n && boxstart(index->boxes[i], axis) <= v; i++)
+        if (within(index->boxes[i], x, y))
+            return index->boxes[i];
+    return 0;
+}
 
 Box *pglocate(Box *box, int x, int y) {
-    if (box)
-        for (Box *i = box->children; i; i = i->next) {
-            bool within =
-                i->x <= x &&
-                i->y <= y &&
-                x <= i->x + i->width &&
-                y <= i->y + i->height;
-            if (within)
-                return pglocate(i, x - i->x, y - i->y);
-        }
+    if (box) {
+        Box     *hit = 0;
+        if (boxindex(box))
+            hit = indexlocate(box->index, x, y);
+        else
+            for (Box *i = box->children; i && !hit; i = i->next)
+                if (within(i, x, y))
+                    hit = i;
+        if (hit)
+            return pglocate(hit, x - hit->x, y - hit->y);
+    }
     return box;
 }
 
@@ -1271,11 +5002,16 @@ Canvas *pgboxsubcanvas(Canvas *g, Box *box) {
 
 void pgfocus(Box *box) {
     if (box)
-        focus = box;
+        pgboxcontext(box)->focus = box;
 }
 
 Box *pggetfocus() {
-    return focus;
+    return pgboxcontext(0)->focus;
+}
+
+// The focus of the context box belongs to.
+Box *pgfocused(Box *box) {
+    return pgboxcontext(box)->focus;
 }
 
 void pgaddbox(Box *parent, Box *child) {
@@ -1288,14 +5024,19 @@ void pgaddbox(Box *parent, Box *child) {
         *p = child;
 
         child->parent = parent;
+        inheritcontext(child, parent->context);
+        placetree(child);
+        freeindex(parent);
+        pgrelayout(parent);
     }
 }
 
 void pgremovebox(Box *child) {
     if (child && child->parent) {
 
-        if (child == pggetfocus())
-            pgfocus(child->parent);
+        Context *ctx = pgboxcontext(child);
+        if (ctx->focus == child)
+            ctx->focus = child->parent;
 
         Box     **p = &child->parent->children;
         while (*p && *p != child)
@@ -1304,7 +5045,11 @@ void pgremovebox(Box *child) {
         if (*p)
             *p = (*p)->next;
 
+        freeindex(child->parent);
+        pgrelayout(child->parent);
+
         child->parent = 0;
+        placetree(child);
     }
 }
 
@@ -1335,25 +5080,338 @@ void pgboxchars(Box *box, const char *text) {
     }
 }
 
-void pgdrawbox(Canvas *g, Box *box) {
-    if (g && box) {
-        if (box->_->draw && !box->clean) {
-            Canvas *sub = pgboxsubcanvas(g, box);
-            box->clean = true;
-            box->_->draw(box, sub);
-            pgfree(sub);
-        }
+/*
+
+    Parallel Box Drawing.
+
+    Siblings whose rectangles do not overlap may be drawn in any order,
+    so each becomes a task drawing into its own sub-canvas.  Workers pop
+    tasks from the tail of their own deque and steal from the head of
+    the others'.  Overlapping siblings are drawn in order on one thread.
+
+*/
+
+typedef struct {
+    Canvas      *g;
+    Box         *box;
+    int         ox;         // Where g's origin lies in root co-ordinates.
+    int         oy;
+} DrawTask;
+
+typedef struct {
+    DrawPool        *pool;
+    pthread_mutex_t lock;
+    int             head;
+    int             tail;
+    DrawTask        tasks[DRAW_DEQUE];
+} DrawDeque;
+
+struct DrawPool {
+    pthread_mutex_t busy;       // Held by the caller of pgdrawbox().
+    int             nthreads;   // Including the caller of pgdrawbox().
+    pthread_t       *threads;
+    DrawDeque       *deques;
+    pthread_mutex_t lock;       // Guards generation and quit.
+    pthread_cond_t  wake;
+    unsigned        generation;
+    bool            quit;
+    atomic_int      pending;    // Tasks pushed but not finished.
+};
+
+static _Thread_local bool drawing;  // Nested draws stay on this thread.
+
+static void drawone(Canvas *g, Box *box, int ox, int oy) {
+    // Keep the state on the C stack rather than the canvas's save stack,
+    // so deep trees do not run out of save slots and skip boxes.
+    if (box->_->draw && !box->clean) {
+        CanvasState saved = savedstate(g);
+        IntRect     r = boxrect(box);
+        CTM         identity = { 1, 0, 0, 1, 0, 0 };
+        box->clean = true;
+        pgorigin(g, r.ax - ox, r.ay - oy, r.bx - r.ax, r.by - r.ay);
+        pgctm(g, identity);
+        box->_->draw(box, g);
+        loadstate(g, saved);
+    }
+}
+
+static void drawtree(Canvas *g, Box *box, int ox, int oy) {
+    drawone(g, box, ox, oy);
+    for (Box *i = box->children; i; i = i->next)
+        drawtree(g, i, ox, oy);
+}
+
+static bool needsdraw(Box *box) {
+    if (box->_->draw && !box->clean)
+        return true;
+    for (Box *i = box->children; i; i = i->next)
+        if (needsdraw(i))
+            return true;
+    return false;
+}
+
+// Boxes with many children keep the answer in their index.
+static bool disjoint(Box *box) {
+    if (boxindex(box))
+        return box->index->disjoint;
+    for (Box *i = box->children; i; i = i->next)
+        for (Box *j = i->next; j; j = j->next)
+            if (overlaps(i, j))
+                return false;
+    return true;
+}
+
+static bool pushtask(DrawDeque *q, DrawTask t) {
+    pthread_mutex_lock(&q->lock);
+    bool    room = q->tail - q->head < DRAW_DEQUE;
+    if (room)
+        q->tasks[q->tail++ % DRAW_DEQUE] = t;
+    pthread_mutex_unlock(&q->lock);
+    return room;
+}
+
+static bool taketask(DrawPool *pool, int self, DrawTask *t) {
+    for (int n = 0; n < pool->nthreads; n++) {
+        DrawDeque   *q = pool->deques + (self + n) % pool->nthreads;
+        bool        found;
+
+        pthread_mutex_lock(&q->lock);
+        found = q->head < q->tail;
+        if (found)
+            *t = n == 0
+                ? q->tasks[--q->tail % DRAW_DEQUE]
+                : q->tasks[q->head++ % DRAW_DEQUE];
+        pthread_mutex_unlock(&q->lock);
+        if (found)
+            return true;
+    }
+    return false;
+}
 
+static void spawntree(DrawPool *pool, int self, Canvas *g, Box *box,
+    int ox, int oy)
+{
+    drawone(g, box, ox, oy);
+    if (!disjoint(box)) {
         for (Box *i = box->children; i; i = i->next)
-            pgdrawbox(g, i);
+            drawtree(g, i, ox, oy);
+        return;
+    }
+
+    for (Box *i = box->children; i; i = i->next) {
+        if (!needsdraw(i))
+            continue;
+
+        IntRect     r = boxrect(i);
+        Canvas      *sub = pgsubcanvas(g,
+                        r.ax - ox, r.ay - oy, r.bx - r.ax, r.by - r.ay);
+        if (!sub)
+            spawntree(pool, self, g, i, ox, oy);
+        else {
+            atomic_fetch_add(&pool->pending, 1);
+            if (!pushtask(pool->deques + self,
+                    (DrawTask) { sub, i, r.ax, r.ay })) {
+                spawntree(pool, self, sub, i, r.ax, r.ay);
+                pgfree(sub);
+                atomic_fetch_sub(&pool->pending, 1);
+            }
+        }
+    }
+}
+
+static void runtasks(DrawPool *pool, int self) {
+    DrawTask    t;
+    while (atomic_load(&pool->pending) > 0)
+        if (taketask(pool, self, &t)) {
+            spawntree(pool, self, t.g, t.box, t.ox, t.oy);
+            pgfree(t.g);
+            atomic_fetch_sub(&pool->pending, 1);
+        } else
+            sched_yield();
+}
+
+static void *drawworker(void *arg) {
+    DrawDeque   *q = arg;
+    DrawPool    *pool = q->pool;
+    int         self = q - pool->deques;
+    unsigned    seen = 0;
+
+    drawing = true;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->quit && pool->generation == seen)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        bool    quit = pool->quit;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (quit)
+            return 0;
+        runtasks(pool, self);
+    }
+}
+
+static void freedrawpool(DrawPool *pool) {
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        pool->quit = true;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+        for (int i = 1; i < pool->nthreads; i++)
+            pthread_join(pool->threads[i], 0);
+
+        for (int i = 0; i < pool->nthreads; i++)
+            pthread_mutex_destroy(&pool->deques[i].lock);
+        pthread_cond_destroy(&pool->wake);
+        pthread_mutex_destroy(&pool->lock);
+        pthread_mutex_destroy(&pool->busy);
+        free(pool->threads);
+        free(pool->deques);
+        free(pool);
     }
 }
 
+// Draw box's tree on this many threads; 0 uses every CPU, 1 draws in place.
+// Waits for a draw already running on another thread to finish with the
+// old pool; no draw of the tree may start meanwhile (hold pgsdllock() with
+// a scheduler), and it must not be called from a draw callback.
+void pgboxthreads(Box *box, int threads) {
+    Context     *ctx = pgboxcontext(box);
+    DrawPool    *old = ctx->pool;
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    ctx->pool = 0;
+    if (old) {
+        pthread_mutex_lock(&old->busy);
+        pthread_mutex_unlock(&old->busy);
+        freedrawpool(old);
+    }
+
+    if (threads > 1) {
+        DrawPool    *pool = calloc(1, sizeof *pool);
+        pool->threads = calloc(threads, sizeof *pool->threads);
+        pool->deques = calloc(threads, sizeof *pool->deques);
+        pthread_mutex_init(&pool->busy, 0);
+        pthread_mutex_init(&pool->lock, 0);
+        pthread_cond_init(&pool->wake, 0);
+        for (int i = 0; i < threads; i++) {
+            pool->deques[i].pool = pool;
+            pthread_mutex_init(&pool->deques[i].lock, 0);
+        }
+
+        // Slot 0 belongs to whichever thread calls pgdrawbox().
+        pool->nthreads = 1;
+        while (pool->nthreads < threads &&
+            pthread_create(pool->threads + pool->nthreads, 0, drawworker,
+                pool->deques + pool->nthreads) == 0)
+            pool->nthreads++;
+
+        if (pool->nthreads > 1)
+            ctx->pool = pool;
+        else
+            freedrawpool(pool);
+    }
+}
+
+void pgdrawbox(Canvas *g, Box *box) {
+    if (g && box) {
+        DrawPool    *pool = pgboxcontext(box)->pool;
+        if (pool && !drawing && g->_ == &bitmapmethods && needsdraw(box)) {
+            pthread_mutex_lock(&pool->busy);
+            drawing = true;
+            spawntree(pool, 0, g, box, 0, 0);
+            if (atomic_load(&pool->pending) > 0) {
+                pthread_mutex_lock(&pool->lock);
+                pool->generation++;
+                pthread_cond_broadcast(&pool->wake);
+                pthread_mutex_unlock(&pool->lock);
+                runtasks(pool, 0);
+            }
+            drawing = false;
+            pthread_mutex_unlock(&pool->busy);
+        } else
+            drawtree(g, box, 0, 0);
+    }
+}
+
+// Redraw a subtree that moved without changing size.
+static void movetree(Box *box) {
+    placebox(box);
+    box->clean = false;
+    for (Box *i = box->children; i; i = i->next)
+        movetree(i);
+}
+
+static void dirtytree(Box *box) {
+    box->clean = false;
+    for (Box *i = box->children; i; i = i->next)
+        dirtytree(i);
+}
+
+// Subtrees packed at their current size and not invalidated are skipped.
 void pgpack(Box *box) {
     if (box) {
+        int     oldx = box->absx;
+        int     oldy = box->absy;
+        bool    same =
+            box->packed &&
+            box->packw == box->width &&
+            box->packh == box->height;
+
+        placebox(box);
+        if (same) {
+            if (box->absx != oldx || box->absy != oldy)
+                movetree(box);
+            return;
+        }
+
+        box->packed = true;
+        box->packw = box->width;
+        box->packh = box->height;
         box->clean = false;
         if (box->_->pack)
             box->_->pack(box);
+        // Place children the pack method did not pgpack().
+        for (Box *i = box->children; i; i = i->next)
+            if (!box->_->pack
+                || i->absx != box->absx + i->x
+                || i->absy != box->absy + i->y)
+                placetree(i);
+        indexbox(box);
+
+        // Drawing this box covers its children.
+        if (box->_->draw)
+            dirtytree(box);
+    }
+}
+
+// Make the next pgpack() of box and its ancestors lay them out again.
+void pgrelayout(Box *box) {
+    for (Box *i = box; i; i = i->parent)
+        i->packed = false;
+}
+
+// Move box within its parent.  Go through here, or call pgplacebox() after
+// setting x and y directly, so the parent's hit-test index is dropped.
+void pgmovebox(Box *box, int x, int y, int width, int height) {
+    if (box) {
+        if (box->parent)
+            freeindex(box->parent);
+        box->x = x;
+        box->y = y;
+        box->width = width;
+        box->height = height;
+        pgpack(box);
+    }
+}
+
+// Take in x and y set directly on box, as pgmovebox() would.
+void pgplacebox(Box *box) {
+    if (box) {
+        if (box->parent)
+            freeindex(box->parent);
+        movetree(box);
     }
 }
 
@@ -1382,8 +5440,7 @@ static void defaultpack(Box *box) {
 }
 
 static void defaultdraw(Box *box, Canvas *g) {
-    (void) box;
-    pgclear(g, pgthemebg());
+    pgclear(g, pgboxcontext(box)->bg);
 }
 
 static void horizpack(Box *box) {
@@ -1434,15 +5491,16 @@ static void vertpack(Box *box) {
 
 static void label_draw(Box *box, Canvas *g) {
     if ((void*) box->sys) {
-        Font        *font = pgthemefont();
+        Context     *ctx = pgboxcontext(box);
+        Font        *font = ctx->font;
         char        *text = (char*) box->sys;
         Point       sz = pgmeasure(font, text);
         Point       at = pt(box->width / 2 - sz.x / 2,
                             box->height / 2 - sz.y / 2);
 
-        pgclear(g, themebg);
+        pgclear(g, ctx->bg);
         pgstring(g, font, at, text);
-        pgfill(g, themefg);
+        pgfill(g, ctx->fg);
     }
 }
 
@@ -1480,24 +5538,25 @@ TextBoxData *pgtextboxdata(const char *text) {
 
 static void textbox_draw(Box *box, Canvas *g) {
     if ((void*) box->sys) {
-        Font        *font = pgthemefont();
+        Context     *ctx = pgboxcontext(box);
+        Font        *font = ctx->font;
         TextBoxData *data = (TextBoxData*) box->sys;
         char        *text = data->buf;
         Point       p = pt(0, 0);
 
-        pgclear(g, themebg);
+        pgclear(g, ctx->bg);
 
         p = pgmeasure(font, "i");
         p.y = g->height * 0.5f - p.y * 0.5f;
 
         pgstring(g, font, p, text);
-        pgfill(g, themefg);
+        pgfill(g, ctx->fg);
 
         for (int i = 0; i < data->caret; i++)
             p = pgcharadvance(font, p, text[i]);
-        pgstrokeline(g, 2, themeaccent, p, pt(p.x, p.y + themefontsz));
+        pgstrokeline(g, 2, ctx->accent, p, pt(p.x, p.y + ctx->fontsz));
 
-        pgstrokerect(g, 1, themefg,
+        pgstrokerect(g, 1, ctx->fg,
             (Rect) {{
                 0.5f,
                 0.5f,
@@ -1602,16 +5661,17 @@ Box *pgtextbox(TextBoxData *data) {
 
 static void button_draw(Box *box, Canvas *g) {
     if ((void*) box->sys) {
-        Font        *font = pgthemefont();
+        Context     *ctx = pgboxcontext(box);
+        Font        *font = ctx->font;
         char        *text = (char*) box->sys;
         Point       sz = pgmeasure(font, text);
         Point       at = pt(box->width / 2 - sz.x / 2,
                             box->height / 2 - sz.y / 2);
 
-        pgclear(g, themebg);
+        pgclear(g, ctx->bg);
         pgstring(g, font, at, text);
-        pgfill(g, pgthemeaccent());
-        pgstrokerect(g, 2, themefg,
+        pgfill(g, ctx->accent);
+        pgstrokerect(g, 2, ctx->fg,
             (Rect) {{
                 1.5f,
                 1.5f,
@@ -2,18 +2,67 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#define PG_STATE_DEPTH 16
+
 typedef struct  Canvas          Canvas;
+typedef struct  CanvasState     CanvasState;
 typedef struct  Point           Point;
 typedef union   Rect            Rect;
 typedef struct  CTM             CTM;
 typedef struct  Colour          Colour;
 typedef struct  Path            Path;
+typedef struct  CompiledPath    CompiledPath;
 typedef struct  Font            Font;
 typedef struct  Box             Box;
+typedef struct  Context         Context;
+typedef struct  DrawPool        DrawPool;
+typedef struct  BoxIndex        BoxIndex;
 typedef struct  IntRect         IntRect;
 typedef struct  Bitmap          Bitmap;
+typedef struct  Mask            Mask;
 typedef struct  OpenTypeFont    OpenTypeFont;
+typedef struct  CompiledFont    CompiledFont;
 typedef struct  TextBoxData     TextBoxData;
+typedef struct  SdfGlyph        SdfGlyph;
+typedef struct  Paint           Paint;
+typedef struct  ColourStop      ColourStop;
+typedef struct  ImageWriter     ImageWriter;
+typedef struct  SharedFrame     SharedFrame;
+
+enum {
+    PG_PAD,         // Paint spread.
+    PG_REPEAT,
+    PG_REFLECT,
+};
+
+enum {
+    PG_NEAREST,     // Image filter.
+    PG_BILINEAR,
+};
+
+enum {
+    PG_AUTO,        // Fill rasterizer.
+    PG_DENSE,
+    PG_SCANLINE,
+};
+
+enum {
+    PG_NONZERO,     // Fill rule.
+    PG_EVENODD,
+};
+
+enum {
+    PG_ARGB,        // Bitmap pixel format: 0xAARRGGBB.
+    PG_ABGR,        // 0xAABBGGRR; RGBA bytes on little-endian.
+    PG_PARGB,       // As PG_ARGB with colour premultiplied by alpha.
+    PG_PABGR,
+};
+
+enum {
+    PG_PPM,         // Image file type.
+    PG_PNG,         // Deflated with fixed codes.
+    PG_PNG_STORE,   // Stored without compression.
+};
 
 struct Colour {
     float       r;
@@ -41,6 +90,26 @@ struct CTM {
     float       f;
 };
 
+struct ColourStop {
+    float       at;
+    Colour      colour;
+};
+
+struct Paint {
+    int         type;       // 0=Solid, 1=Linear, 2=Radial, 3=Image
+    int         spread;     // PG_PAD, PG_REPEAT, PG_REFLECT
+    int         filter;     // PG_NEAREST, PG_BILINEAR
+    Colour      colour;     // Solid colour.
+    Point       a;          // Start or centre.
+    Point       b;          // End.
+    float       radius;
+    int         nstops;
+    ColourStop  *stops;
+    uint32_t    lut[256];   // Colour ramp built from stops.
+    Bitmap      *image;
+    CTM         ctm;        // Image to user space.
+};
+
 struct Path {
     int         np;
     int         capacity;
@@ -50,6 +119,13 @@ struct Path {
     Point       *pts;
 };
 
+struct CompiledPath {
+    int         nedges;
+    Point       *edges;     // Device-space line segments as point pairs.
+    CTM         ctm;        // Transform the edges were built with.
+    Path        *path;      // Copy of the source path.
+};
+
 typedef struct CanvasMethods {
     void        (*free)(Canvas *g);
     Canvas      *(*subcanvas)(Canvas *parent, int ax, int ay, int bx, int by);
@@ -64,8 +140,26 @@ typedef struct CanvasMethods {
     void        (*fill)(Canvas *g, Colour colour);
     void        (*stroke)(Canvas *g, float stroke, Colour colour);
     void        (*strokefill)(Canvas *g, float stroke, Colour cs, Colour cf);
+    void        (*sdf)(Canvas *g, const SdfGlyph *sdf, CTM ctm, Colour colour);
+    void        (*fillpaint)(Canvas *g, const Paint *paint);
+    void        (*blit)(Canvas *g, Canvas *src, IntRect sr, IntRect dr,
+                    int filter);
+    void        (*origin)(Canvas *g, int dx, int dy);
+    void        (*fillcompiled)(Canvas *g, CompiledPath *cp,
+                    const Paint *paint);
+    void        (*fillmask)(Canvas *g, Canvas *mask, int x, int y,
+                    Colour colour);
 } CanvasMethods;
 
+struct CanvasState {
+    int         width;
+    int         height;
+    Rect        clip;
+    CTM         ctm;
+    int         ox;
+    int         oy;
+};
+
 struct Canvas {
     const CanvasMethods *_;
     int         width;
@@ -73,12 +167,33 @@ struct Canvas {
 
     Rect        clip;
     CTM         ctm;
+    bool        linear;     // Blend in linear light; see pggamma().
+    int         rasterizer; // PG_AUTO, PG_DENSE, PG_SCANLINE
+    bool        aliased;    // Fill whole pixels; see pgantialias().
+    int         fillrule;   // PG_NONZERO, PG_EVENODD
+
+    int         ox;         // Origin relative to the underlying surface.
+    int         oy;
+    int         depth;
+    CanvasState saved[PG_STATE_DEPTH];
 };
 
 struct Bitmap {
     Canvas      g;
     int         stride;
     uint32_t    *pixels;
+    int         format;     // PG_ARGB, PG_ABGR, PG_PARGB, PG_PABGR
+    bool        ownpixels;
+    Path        *path;
+    Canvas      *parent;    // Canvas a layer composites into.
+    SharedFrame *shared;    // Shared memory holding the pixels, if any.
+    int         top;        // First row held in pixels; see pgstream().
+};
+
+struct Mask {               // 8-bit coverage; colours draw their alpha.
+    Canvas      g;
+    int         stride;
+    uint8_t     *pixels;
     bool        ownpixels;
     Path        *path;
 };
@@ -87,6 +202,8 @@ typedef struct FontMethods {
     void        (*free)(Font *font);
     void        (*setctm)(Font *font, CTM ctm);
     void        (*glyph)(Canvas *g, Font *font, Point p, unsigned glyph);
+    void        (*outline)(Canvas *g, Font *font, CTM ctm, unsigned glyph);
+    float       (*advance)(Font *font, unsigned glyph);
 } FontMethods;
 
 struct Font {
@@ -101,6 +218,16 @@ struct Font {
     float       descent;
     unsigned    nglyphs;
     uint16_t    *mapping;
+    SdfGlyph    **sdf;      // Lazily generated; indexed by glyph.
+    void        *warmup;    // Running pgwarmfont() thread.
+};
+
+struct SdfGlyph {
+    int         width;
+    int         height;
+    float       spread;     // Texels represented by the full 0-255 range.
+    CTM         ctm;        // Texel to font units.
+    uint8_t     *data;      // 128 is the outline; higher is inside.
 };
 
 struct OpenTypeFont {
@@ -113,6 +240,16 @@ struct OpenTypeFont {
     unsigned    nhmetrics;
 };
 
+struct CompiledFont {
+    Font        f;
+    const float     *advance;
+    const uint32_t  *start;
+    const uint8_t   *shapes;
+    const float     *xs;
+    const float     *ys;
+    uint32_t        npoints;
+};
+
 typedef struct BoxMethods {
     void        (*key)(Box *box, unsigned code, unsigned mod);
     void        (*chars)(Box *box, const char *text);
@@ -129,17 +266,35 @@ struct Box {
     int         width;
     int         height;
     bool        fixed;
+    int         absx;       // Position within the root; see pgplacebox().
+    int         absy;
+    bool        packed;     // Laid out at packw x packh; see pgrelayout().
+    int         packw;
+    int         packh;
 
     bool        clean;
 
     Box         *parent;
     Box         *next;
     Box         *children;
+    Context     *context;   // Shared by the tree; see pgsetcontext().
+    BoxIndex    *index;     // Children for pglocate(); see pgmovebox().
 
     uintptr_t   user;
     uintptr_t   sys;
 };
 
+struct Context {
+    Font        *font;
+    float       fontsz;
+    Colour      fg;
+    Colour      bg;
+    Colour      bg2;
+    Colour      accent;
+    Box         *focus;
+    DrawPool    *pool;      // See pgboxthreads().
+};
+
 struct IntRect {
     int         ax;
     int         ay;
@@ -159,11 +314,31 @@ struct TextBoxData {
 */
 Canvas *pgnewbmp(int width, int height);
 Canvas *pgborrowbmp(uint32_t *pixels, int stride, int width, int height);
+Canvas *pgnewmask(int width, int height);
+Canvas *pgborrowmask(uint8_t *pixels, int stride, int width, int height);
+Canvas *pgpixelformat(Canvas *g, int format);
+Canvas *pgnewshared(int width, int height);
+Canvas *pgimportshared(int fd);
+int pgsharedfd(Canvas *g);
+unsigned pgpublish(Canvas *g);
+unsigned pggeneration(Canvas *g);
 
 Canvas *pgsubcanvas(Canvas *parent, int ax, int ay, int width, int height);
+Canvas *pgpushlayer(Canvas *g, Rect bounds);
+Canvas *pgpoplayer(Canvas *layer, float opacity);
+bool pgstream(int width, int height, int rows,
+    void (*draw)(Canvas *g, void *data),
+    bool (*sink)(const uint32_t *pixels, int width, int height, int y,
+        void *data),
+    void *data);
 
 void *pgfree(Canvas *g);
 
+Canvas *pgsave(Canvas *g);
+Canvas *pgrestore(Canvas *g);
+Canvas *pgorigin(Canvas *g, int ax, int ay, int width, int height);
+Canvas *pgclip(Canvas *g, Rect r);
+
 
 /*
     Drawing.
@@ -177,12 +352,16 @@ Canvas *pgcurve4(Canvas *g, Point b, Point c, Point d);
 
 Canvas *pgclear(Canvas *g, Colour colour);
 Canvas *pgfill(Canvas *g, Colour colour);
+Canvas *pgfillpaint(Canvas *g, const Paint *paint);
 Canvas *pgstroke(Canvas *g, float stroke, Colour colour);
 Canvas *pgstrokefill(Canvas *g, float stroke, Colour cs, Colour cf);
 
 Canvas *pgstrokeline(Canvas *g, float stroke, Colour colour, Point a, Point b);
 Canvas *pgfillrect(Canvas *g, Colour colour, Rect r);
 Canvas *pgstrokerect(Canvas *g, float stroke, Colour colour, Rect r);
+Canvas *pgblit(Canvas *g, Canvas *src, IntRect srcrect, IntRect dstrect,
+    int filter);
+Canvas *pgfillmask(Canvas *g, Canvas *mask, int x, int y, Colour colour);
 
 Point pgchar(Canvas *g, Font *font, Point p, unsigned c);
 Point pgstring(Canvas *g, Font *font, Point p, const char *str);
@@ -195,24 +374,38 @@ Canvas *pgidentity(Canvas *g);
 Canvas *pgtranslate(Canvas *g, float x, float y);
 Canvas *pgscale(Canvas *g, float x, float y);
 Canvas *pgrotate(Canvas *g, float rad);
+Canvas *pgrasterizer(Canvas *g, int rasterizer);
+Canvas *pgantialias(Canvas *g, bool antialias);
+Canvas *pgfillrule(Canvas *g, int fillrule);
+Canvas *pggamma(Canvas *g, bool linear);
 
 
 /*
     Fonts.
 */
 Font *pgfontfile(const char *file, int index);
+bool pgsavefont(Font *font, const char *file);
 void pgfreefont(Font *font);
 Font *pgfontctm(Font *font, CTM ctm);
 Font *pgscalefont(Font *font, float xpx, float ypx);
 Point pgglyphadvance(Font *font, Point p, unsigned glyph);
 Point pgcharadvance(Font *font, Point p, unsigned c);
 Point pgmeasure(Font *font, const char *text);
+Font *pgwarmfont(Font *font, const char *chars, bool sdf);
+Font *pgwaitfont(Font *font);
+
+SdfGlyph *pgglyphsdf(Font *font, unsigned glyph);
+Point pgsdfglyph(Canvas *g, Font *font, Point p, unsigned glyph, Colour colour);
+Point pgsdfchar(Canvas *g, Font *font, Point p, unsigned c, Colour colour);
+Point pgsdfstring(Canvas *g, Font *font, Point p, const char *str,
+    Colour colour);
 
 
 /*
     Paths.
 */
 Path *pgpath(int capacity);
+void *pgfreepath(Path *path);
 Path *pgpmove(Path *path, Point a);
 Path *pgpline(Path *path, Point b);
 Path *pgpcurve3(Path *path, Point b, Point c);
@@ -220,22 +413,59 @@ Path *pgpcurve4(Path *path, Point b, Point c, Point d);
 Path *pgpclose(Path *path);
 Path *pgpclean(Path *path);
 
+CompiledPath *pgcompilepath(CompiledPath *cp, Path *path, CTM ctm);
+void *pgfreecompiled(CompiledPath *cp);
+Canvas *pgfillcompiled(Canvas *g, CompiledPath *cp, Colour colour);
+Canvas *pgpaintcompiled(Canvas *g, CompiledPath *cp, const Paint *paint);
+
+
+/*
+    Paints.
+*/
+Paint *pglinear(Point a, Point b, int spread);
+Paint *pgradial(Point centre, float radius, int spread);
+Paint *pgpattern(Canvas *image, CTM ctm, int spread, int filter);
+Paint *pgaddstop(Paint *paint, float at, Colour colour);
+void *pgfreepaint(Paint *paint);
+
+
+/*
+    Image files.
+*/
+ImageWriter *pgopenimage(const char *file, int type, int width, int height);
+bool pgwriterows(ImageWriter *w, const uint32_t *pixels, int stride, int rows,
+    int format);
+bool pgcloseimage(ImageWriter *w);
+bool pgimagesink(const uint32_t *pixels, int width, int height, int y,
+    void *writer);
+bool pgsaveimage(Canvas *g, const char *file, int type);
+
 
 /*
     Boxes.
 */
-const BoxMethods pgbox_default;
-const BoxMethods pgbox_horizstack;
-const BoxMethods pgbox_vertstack;
-const BoxMethods pgbox_label;
-const BoxMethods pgbox_textbox;
-const BoxMethods pgbox_button;
+extern const BoxMethods pgbox_default;
+extern const BoxMethods pgbox_horizstack;
+extern const BoxMethods pgbox_vertstack;
+extern const BoxMethods pgbox_label;
+extern const BoxMethods pgbox_textbox;
+extern const BoxMethods pgbox_button;
+
+Context *pgnewcontext(void);
+void pgfreecontext(Context *ctx);
+Box *pgsetcontext(Box *box, Context *ctx);
+Context *pgboxcontext(Box *box);
 
 void pgfocus(Box *box);
-Box *pggetfocus();
+// Deprecated: the default context's focus; use pgfocused().
+__attribute__((deprecated)) Box *pggetfocus();
+Box *pgfocused(Box *box);
 void pgaddbox(Box *parent, Box *child);
 void pgremovebox(Box *child);
 void pgpack(Box *box);
+void pgrelayout(Box *box);
+void pgmovebox(Box *box, int x, int y, int width, int height);
+void pgplacebox(Box *box);
 Box *pgoverridebox(Box *box, BoxMethods meth);
 
 Box *pglocate(Box *box, int x, int y);
@@ -245,6 +475,7 @@ void pgboxclicked(Box *box, int x, int y);
 void pgboxkey(Box *box, unsigned code, unsigned mod);
 void pgboxchars(Box *box, const char *text);
 void pgdrawbox(Canvas *g, Box *box);
+void pgboxthreads(Box *box, int threads);
 
 Box *pgbox(BoxMethods *methods);
 Box *pgstackbox(bool horizontal);
@@ -254,11 +485,12 @@ Box *pgbutton(char *text);
 
 TextBoxData *pgtextboxdata(const char *text);
 
-Font *pgthemefont();
-Colour pgthemefg();
-Colour pgthemebg();
-Colour pgthemebg2();
-Colour pgthemeaccent();
+// Deprecated: the default context's theme; use pgboxcontext().
+__attribute__((deprecated)) Font *pgthemefont();
+__attribute__((deprecated)) Colour pgthemefg();
+__attribute__((deprecated)) Colour pgthemebg();
+__attribute__((deprecated)) Colour pgthemebg2();
+__attribute__((deprecated)) Colour pgthemeaccent();
 
 
 /*
@@ -279,6 +511,7 @@ static inline uint32_t packrgb(Colour colour);
 static inline Colour unpackrgb(uint32_t colour);
 static inline Point pgapplyctm(CTM ctm, Point p);
 static inline CTM pgmulctm(CTM x, CTM y);
+static inline CTM pginvertctm(CTM m);
 
 
 static inline Point pt(float x, float y) {
@@ -340,3 +573,16 @@ static inline CTM pgmulctm(CTM x, CTM y) {
         (x.e * y.b) + (x.f * y.d) + (1 * y.f),
     };
 }
+
+static inline CTM pginvertctm(CTM m) {
+    float   det = m.a * m.d - m.b * m.c;
+    float   id = det? 1 / det: 0;
+    return (CTM) {
+        m.d * id,
+        -m.b * id,
+        -m.c * id,
+        m.a * id,
+        (m.c * m.f - m.d * m.e) * id,
+        (m.b * m.e - m.a * m.f) * id,
+    };
+}
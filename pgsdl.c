@@ -0,0 +1,447 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include <pg.h>
+#include <pgsdl.h>
+
+/*
+
+    Damage.
+
+*/
+
+static void adddamage(Damage *d, IntRect r, int width, int height) {
+    if (r.ax < 0) r.ax = 0;
+    if (r.ay < 0) r.ay = 0;
+    if (r.bx > width) r.bx = width;
+    if (r.by > height) r.by = height;
+    if (r.ax >= r.bx || r.ay >= r.by)
+        return;
+
+    for (int i = 0; i < d->n; i++) {
+        SDL_Rect    *o = d->rect + i;
+        if (o->x <= r.ax && o->y <= r.ay
+            && r.bx <= o->x + o->w && r.by <= o->y + o->h)
+            return;
+    }
+
+    // Out of slots; collapse everything into one bounding rectangle.
+    if (d->n == PGSDL_MAX_DAMAGE) {
+        for (int i = 0; i < d->n; i++) {
+            SDL_Rect    *o = d->rect + i;
+            if (o->x < r.ax) r.ax = o->x;
+            if (o->y < r.ay) r.ay = o->y;
+            if (o->x + o->w > r.bx) r.bx = o->x + o->w;
+            if (o->y + o->h > r.by) r.by = o->y + o->h;
+        }
+        d->n = 0;
+    }
+    d->rect[d->n++] = (SDL_Rect) { r.ax, r.ay, r.bx - r.ax, r.by - r.ay };
+}
+
+// Damage the rectangle of every box pgdrawbox() would redraw.
+static void damagetree(Damage *d, Canvas *g, Box *box) {
+    if (box->_->draw && !box->clean)
+        adddamage(d,
+            (IntRect) {
+                box->absx,
+                box->absy,
+                box->absx + box->width,
+                box->absy + box->height
+            },
+            g->width,
+            g->height);
+    for (Box *i = box->children; i; i = i->next)
+        damagetree(d, g, i);
+}
+
+static void dirtybox(Box *box) {
+    box->clean = false;
+    for (Box *i = box->children; i; i = i->next)
+        dirtybox(i);
+}
+
+/*
+
+    SDL Presenter.
+
+*/
+
+// Pixel format of a surface we can draw into directly, or -1.
+static int surfaceformat(SDL_Surface *s) {
+    switch (s->format->format) {
+    case SDL_PIXELFORMAT_ARGB8888:
+    case SDL_PIXELFORMAT_RGB888:
+        return PG_ARGB;
+    case SDL_PIXELFORMAT_ABGR8888:
+    case SDL_PIXELFORMAT_BGR888:
+        return PG_ABGR;
+    }
+    return -1;
+}
+
+// Copy damaged rectangles of a bitmap into the surface, converting only
+// when the bitmap is not already in the surface's format.
+static void upload(SDL_Surface *s, Bitmap *src, Damage *d) {
+    int     bpp = s->format->BytesPerPixel;
+    bool    same = surfaceformat(s) == src->format;
+    if (SDL_MUSTLOCK(s))
+        SDL_LockSurface(s);
+    for (int i = 0; i < d->n; i++) {
+        SDL_Rect    *r = d->rect + i;
+        uint32_t    *from = src->pixels + r->y * src->stride + r->x;
+        uint8_t     *to = (uint8_t*) s->pixels + r->y * s->pitch + r->x * bpp;
+        if (same)
+            for (int y = 0; y < r->h; y++)
+                memcpy(
+                    to + y * s->pitch,
+                    from + y * src->stride,
+                    r->w * sizeof *from);
+        else
+            SDL_ConvertPixels(
+                r->w,
+                r->h,
+                src->format == PG_ABGR
+                    ? SDL_PIXELFORMAT_ABGR8888
+                    : SDL_PIXELFORMAT_ARGB8888,
+                from,
+                src->stride * 4,
+                s->format->format,
+                to,
+                s->pitch);
+    }
+    if (SDL_MUSTLOCK(s))
+        SDL_UnlockSurface(s);
+}
+
+Presenter *pgsdlpresenter(SDL_Window *window) {
+    Presenter   *p = calloc(1, sizeof *p);
+    p->window = window;
+    return p;
+}
+
+void pgsdlfree(Presenter *p) {
+    if (p) {
+        if (p->locked)
+            SDL_UnlockSurface(p->surface);
+        pgfree(p->g);
+        free(p);
+    }
+}
+
+Canvas *pgsdlbegin(Presenter *p) {
+    SDL_Surface *s = SDL_GetWindowSurface(p->window);
+    if (!s)
+        return 0;
+
+    bool    replaced = s != p->surface
+        || !p->g
+        || p->g->width != s->w
+        || p->g->height != s->h;
+
+    // A replaced surface has already been freed by SDL.
+    if (p->locked && s == p->surface)
+        SDL_UnlockSurface(s);
+    p->locked = false;
+    p->surface = s;
+
+    int     format = surfaceformat(s);
+    if (format >= 0) {
+        if (SDL_MUSTLOCK(s)) {
+            SDL_LockSurface(s);
+            p->locked = true;
+        }
+        // Locking may move the pixels.
+        if (!replaced && p->direct
+            && ((Bitmap*) p->g)->pixels != s->pixels)
+            replaced = true;
+    }
+
+    if (replaced) {
+        pgfree(p->g);
+        p->direct = format >= 0;
+        p->g = p->direct
+            ? pgpixelformat(
+                pgborrowbmp(s->pixels, s->pitch / 4, s->w, s->h),
+                format)
+            : pgnewbmp(s->w, s->h);
+        p->fresh = true;
+        p->damage.n = 0;
+        pgsdldamage(p, (IntRect) { 0, 0, s->w, s->h });
+    } else
+        p->fresh = false;
+    return p->g;
+}
+
+void pgsdldamage(Presenter *p, IntRect r) {
+    if (p->g)
+        adddamage(&p->damage, r, p->g->width, p->g->height);
+}
+
+void pgsdldamagebox(Presenter *p, Box *box) {
+    if (p->g && box)
+        damagetree(&p->damage, p->g, box);
+}
+
+void pgsdldrawbox(Presenter *p, Box *box) {
+    if (p->g && box) {
+        if (p->fresh)
+            dirtybox(box);
+        pgsdldamagebox(p, box);
+        pgdrawbox(p->g, box);
+    }
+}
+
+void pgsdlpresent(Presenter *p) {
+    SDL_Surface *s = p->surface;
+    if (!p->g || !s)
+        return;
+
+    if (!p->direct)
+        upload(s, (Bitmap*) p->g, &p->damage);
+    else if (p->locked) {
+        SDL_UnlockSurface(s);
+        p->locked = false;
+    }
+
+    if (p->damage.n)
+        SDL_UpdateWindowSurfaceRects(p->window, p->damage.rect, p->damage.n);
+    p->damage.n = 0;
+}
+
+/*
+
+    Frame Scheduler.
+
+    The render thread draws into the back buffer while the event thread
+    shows the front one.  A finished back buffer waits until the event
+    thread has taken its SDL event and swapped, so a buffer is never
+    drawn into while it may be on its way to the screen.
+
+    The window surface cannot be one of the pair: SDL owns it, replaces
+    it on resize, and it must only be touched on the event thread.  So
+    showing a frame copies its damaged rectangles into the surface.  The
+    buffers are kept in the surface's format, so this is a row copy.
+
+*/
+
+struct Scheduler {
+    Presenter       *presenter;
+    Box             *root;
+    pthread_t       thread;
+    pthread_mutex_t tree;       // Held while the box tree is used.
+    pthread_mutex_t lock;       // Guards the fields below.
+    pthread_cond_t  wake;
+    Uint32          event;
+    bool            pending;    // A frame has been requested.
+    bool            ready;      // Back holds a finished frame.
+    bool            unshown;    // Back's frame could not be posted.
+    bool            quit;
+    int             front;      // -1 until the first frame is shown.
+    int             format;     // Buffers' pixel format; the surface's.
+    Canvas          *buffers[2];
+    Damage          damage[2];  // What each buffer's last frame redrew.
+};
+
+// Bring a buffer up to date with the frame after it.
+static void copyforward(Bitmap *dst, Bitmap *src, Damage *d) {
+    for (int i = 0; i < d->n; i++) {
+        SDL_Rect    *r = d->rect + i;
+        for (int y = r->y; y < r->y + r->h; y++)
+            memcpy(
+                dst->pixels + y * dst->stride + r->x,
+                src->pixels + y * src->stride + r->x,
+                r->w * sizeof *dst->pixels);
+    }
+}
+
+// Draw the next frame into back. If back already holds a frame that was
+// never shown, draw on top of it and add to its damage.
+static void drawframe(Scheduler *s, int front, int back, bool unshown,
+    int format)
+{
+    Box     *root = s->root;
+    Canvas  *g = s->buffers[back];
+    Canvas  *f = front < 0? 0: s->buffers[front];
+    Damage  *d = s->damage + back;
+
+    if (!unshown)
+        d->n = 0;
+    if (!g || g->width != root->width || g->height != root->height
+        || ((Bitmap*) g)->format != format)
+    {
+        pgfree(g);
+        g = s->buffers[back] = root->width > 0 && root->height > 0
+            ? pgpixelformat(pgnewbmp(root->width, root->height), format)
+            : 0;
+        if (!g)
+            return;
+        f = 0;
+        d->n = 0;
+    }
+
+    if (f && f->width == g->width && f->height == g->height
+        && ((Bitmap*) f)->format == format)
+    {
+        if (!unshown)
+            copyforward((Bitmap*) g, (Bitmap*) f, s->damage + front);
+        damagetree(d, g, root);
+    } else {
+        dirtybox(root);
+        adddamage(d, (IntRect) { 0, 0, g->width, g->height },
+            g->width, g->height);
+    }
+    pgdrawbox(g, root);
+}
+
+static void *renderframes(void *data) {
+    Scheduler   *s = data;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (!s->quit && (!s->pending || s->ready))
+            pthread_cond_wait(&s->wake, &s->lock);
+        if (s->quit)
+            break;
+
+        int     front = s->front;
+        int     back = front < 0? 0: front ^ 1;
+        bool    unshown = s->unshown;
+        int     format = s->format;
+        s->pending = false;
+        s->unshown = false;
+        pthread_mutex_unlock(&s->lock);
+
+        pthread_mutex_lock(&s->tree);
+        drawframe(s, front, back, unshown, format);
+        pthread_mutex_unlock(&s->tree);
+
+        // A full queue drops the event; the next request redraws on top.
+        pthread_mutex_lock(&s->lock);
+        if (s->damage[back].n) {
+            SDL_Event   e = { .type = s->event };
+            e.user.code = back;
+            s->ready = true;
+            if (SDL_PushEvent(&e) <= 0) {
+                s->ready = false;
+                s->unshown = true;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+static void show(Scheduler *s, bool all) {
+    Presenter   *p = s->presenter;
+    Canvas      *g = s->front < 0? 0: s->buffers[s->front];
+    SDL_Surface *surface = SDL_GetWindowSurface(p->window);
+    if (!g || !surface)
+        return;
+
+    // The surface may not have caught up with a resize yet.
+    int         width = g->width < surface->w? g->width: surface->w;
+    int         height = g->height < surface->h? g->height: surface->h;
+    Damage      *d = s->damage + s->front;
+    Damage      clipped = { 0 };
+    if (all || surface != p->surface)
+        adddamage(&clipped, (IntRect) { 0, 0, width, height }, width, height);
+    else
+        for (int i = 0; i < d->n; i++) {
+            SDL_Rect    *r = d->rect + i;
+            adddamage(&clipped,
+                (IntRect) { r->x, r->y, r->x + r->w, r->y + r->h },
+                width,
+                height);
+        }
+    p->surface = surface;
+
+    // Later frames are drawn in the format of a replaced surface.
+    int         format = surfaceformat(surface);
+    if (format >= 0 && format != s->format) {
+        pthread_mutex_lock(&s->lock);
+        s->format = format;
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    upload(surface, (Bitmap*) g, &clipped);
+    if (clipped.n)
+        SDL_UpdateWindowSurfaceRects(p->window, clipped.rect, clipped.n);
+}
+
+Scheduler *pgsdlscheduler(SDL_Window *window, Box *root) {
+    Scheduler   *s = calloc(1, sizeof *s);
+    s->presenter = pgsdlpresenter(window);
+    s->root = root;
+    s->front = -1;
+    s->event = SDL_RegisterEvents(1);
+
+    SDL_Surface *surface = SDL_GetWindowSurface(window);
+    int         format = surface? surfaceformat(surface): -1;
+    s->format = format >= 0? format: PG_ARGB;
+    pthread_mutex_init(&s->tree, 0);
+    pthread_mutex_init(&s->lock, 0);
+    pthread_cond_init(&s->wake, 0);
+    if (s->event == (Uint32) -1
+        || pthread_create(&s->thread, 0, renderframes, s) != 0) {
+        pgsdlfree(s->presenter);
+        free(s);
+        return 0;
+    }
+    return s;
+}
+
+void pgsdlstop(Scheduler *s) {
+    if (s) {
+        pthread_mutex_lock(&s->lock);
+        s->quit = true;
+        pthread_cond_signal(&s->wake);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, 0);
+
+        pgfree(s->buffers[0]);
+        pgfree(s->buffers[1]);
+        pgsdlfree(s->presenter);
+        pthread_cond_destroy(&s->wake);
+        pthread_mutex_destroy(&s->lock);
+        pthread_mutex_destroy(&s->tree);
+        free(s);
+    }
+}
+
+void pgsdllock(Scheduler *s) {
+    pthread_mutex_lock(&s->tree);
+}
+
+void pgsdlunlock(Scheduler *s) {
+    pthread_mutex_unlock(&s->tree);
+}
+
+void pgsdlrequest(Scheduler *s) {
+    pthread_mutex_lock(&s->lock);
+    s->pending = true;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Show a finished frame; false if the event is not the scheduler's.
+bool pgsdlframe(Scheduler *s, SDL_Event *e) {
+    if (e->type != s->event)
+        return false;
+
+    pthread_mutex_lock(&s->lock);
+    s->front = e->user.code;
+    s->ready = false;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+
+    show(s, false);
+    return true;
+}
+
+void pgsdlexpose(Scheduler *s) {
+    show(s, true);
+}
@@ -0,0 +1,59 @@
+/*
+
+    SDL presenter.
+
+    Draws straight into a window's surface and uploads only the damaged
+    rectangles.  Include after <SDL2/SDL.h> and <pg.h>.
+
+*/
+
+#define PGSDL_MAX_DAMAGE 32
+
+typedef struct Presenter Presenter;
+typedef struct Scheduler Scheduler;
+
+typedef struct {
+    int         n;
+    SDL_Rect    rect[PGSDL_MAX_DAMAGE];
+} Damage;
+
+struct Presenter {
+    SDL_Window  *window;
+    SDL_Surface *surface;   // Surface the canvas was made for.
+    Canvas      *g;
+    bool        direct;     // Canvas borrows the surface's pixels.
+    bool        fresh;      // Surface was replaced; contents are undefined.
+    bool        locked;
+    Damage      damage;
+};
+
+Presenter *pgsdlpresenter(SDL_Window *window);
+void pgsdlfree(Presenter *p);
+Canvas *pgsdlbegin(Presenter *p);
+void pgsdldamage(Presenter *p, IntRect r);
+void pgsdldamagebox(Presenter *p, Box *box);
+void pgsdldrawbox(Presenter *p, Box *box);
+void pgsdlpresent(Presenter *p);
+
+/*
+
+    Frame scheduler.
+
+    Draws the box tree on its own thread into one of two buffers while the
+    event thread carries on.  Requests made while a frame is in progress
+    are coalesced into the next one.  Hold pgsdllock() while touching the
+    tree, and pass every event to pgsdlframe() first.
+
+    The render thread holds the same lock for the whole of each frame's
+    drawing, so pgsdllock() can wait for up to one frame.  Take it once
+    for a batch of events rather than once per event.
+
+*/
+
+Scheduler *pgsdlscheduler(SDL_Window *window, Box *root);
+void pgsdlstop(Scheduler *s);
+void pgsdllock(Scheduler *s);
+void pgsdlunlock(Scheduler *s);
+void pgsdlrequest(Scheduler *s);
+bool pgsdlframe(Scheduler *s, SDL_Event *e);
+void pgsdlexpose(Scheduler *s);
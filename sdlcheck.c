@@ -0,0 +1,196 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+#include <pg.h>
+#include <pgsdl.h>
+
+// Checks of the SDL presenter and frame scheduler on SDL's dummy video
+// driver, so they run without a display.  Exits non-zero if any check fails.
+
+static int  failures;
+
+static void check(bool ok, const char *what) {
+    printf("%-48s %s\n", what, ok? "ok": "FAILED");
+    failures += !ok;
+}
+
+// Fill a box with the 0xRRGGBB colour kept in its user field.
+static void solid(Box *box, Canvas *g) {
+    uint32_t    c = box->user;
+    pgclear(g, (Colour) {
+        (c >> 16 & 255) / 255.0f,
+        (c >> 8 & 255) / 255.0f,
+        (c & 255) / 255.0f,
+        1 });
+}
+
+static BoxMethods   solidmethods = { .draw = solid };
+
+static Box *solidbox(Box *parent, int x, int y, int width, int height,
+    uint32_t colour)
+{
+    Box     *box = pgbox(&solidmethods);
+    box->x = x;
+    box->y = y;
+    box->width = width;
+    box->height = height;
+    box->user = colour;
+    if (parent)
+        pgaddbox(parent, box);
+    return box;
+}
+
+// The window surface's pixel as 0xRRGGBB; the dummy driver uses XRGB8888.
+static uint32_t shown(SDL_Window *window, int x, int y) {
+    SDL_Surface *s = SDL_GetWindowSurface(window);
+    return ((uint32_t*) ((uint8_t*) s->pixels + y * s->pitch))[x] & 0xffffff;
+}
+
+static bool samerect(SDL_Rect r, int x, int y, int width, int height) {
+    return r.x == x && r.y == y && r.w == width && r.h == height;
+}
+
+
+/*
+
+    Presenter.
+
+*/
+
+
+static void presenter(SDL_Window *window) {
+    Box         *root = solidbox(0, 0, 0, 200, 100, 0x808080);
+    solidbox(root, 10, 10, 20, 20, 0xff0000);
+    Box         *b = solidbox(root, 50, 5, 30, 40, 0x0000ff);
+    Presenter   *p = pgsdlpresenter(window);
+
+    Canvas      *g = pgsdlbegin(p);
+    check(g && p->fresh, "first frame gets a fresh canvas");
+    check(p->damage.n == 1 && samerect(p->damage.rect[0], 0, 0, 200, 100),
+        "fresh canvas damages the whole window");
+    pgsdldrawbox(p, root);
+    pgsdlpresent(p);
+    check(shown(window, 5, 5) == 0x808080
+        && shown(window, 15, 15) == 0xff0000
+        && shown(window, 60, 20) == 0x0000ff,
+        "first frame reaches the window");
+
+    check(pgsdlbegin(p) == g && !p->fresh,
+        "same size keeps the canvas");
+    b->user = 0x00ff00;
+    b->clean = false;
+    pgsdldrawbox(p, root);
+    check(p->damage.n == 1 && samerect(p->damage.rect[0], 50, 5, 30, 40),
+        "damage is only the dirty box");
+    pgsdlpresent(p);
+    check(shown(window, 60, 20) == 0x00ff00
+        && shown(window, 15, 15) == 0xff0000,
+        "dirty box is redrawn, the rest kept");
+
+    pgsdlbegin(p);
+    pgsdldrawbox(p, root);
+    check(p->damage.n == 0, "clean tree damages nothing");
+    pgsdlpresent(p);
+
+    SDL_SetWindowSize(window, 300, 150);
+    root->width = 300;
+    root->height = 150;
+    g = pgsdlbegin(p);
+    check(g && p->fresh && g->width == 300 && g->height == 150,
+        "resize replaces the canvas");
+    pgsdldrawbox(p, root);
+    check(p->damage.n == 1 && samerect(p->damage.rect[0], 0, 0, 300, 150),
+        "resize redraws the whole window");
+    pgsdlpresent(p);
+    check(shown(window, 250, 120) == 0x808080
+        && shown(window, 15, 15) == 0xff0000,
+        "resized frame reaches the window");
+
+    pgsdlfree(p);
+}
+
+
+/*
+
+    Frame scheduler.
+
+*/
+
+
+static atomic_int   frames;     // Ticker draws, one per scheduled frame.
+static atomic_bool  hold;       // Keeps the frame in progress from ending.
+
+// Redraws on every frame, and can be held part way through one.
+static void ticker(Box *box, Canvas *g) {
+    atomic_fetch_add(&frames, 1);
+    while (atomic_load(&hold))
+        SDL_Delay(1);
+    box->clean = false;
+    solid(box, g);
+}
+
+static BoxMethods   tickermethods = { .draw = ticker };
+
+// Show frames until none arrives for a while; returns how many.
+static int showframes(Scheduler *s) {
+    int     n = 0;
+    for (int idle = 0; idle < 200; idle++) {
+        SDL_Event   e;
+        if (SDL_PollEvent(&e) && pgsdlframe(s, &e)) {
+            n++;
+            idle = 0;
+        } else
+            SDL_Delay(1);
+    }
+    return n;
+}
+
+static void scheduler(SDL_Window *window) {
+    int         width;
+    int         height;
+    SDL_GetWindowSize(window, &width, &height);
+    Box         *root = solidbox(0, 0, 0, width, height, 0x808080);
+    Box         *tick = solidbox(root, 10, 10, 20, 20, 0xff0000);
+    tick->_ = &tickermethods;
+    Scheduler   *s = pgsdlscheduler(window, root);
+
+    pgsdlrequest(s);
+    check(showframes(s) == 1, "one request shows one frame");
+    check(shown(window, 5, 5) == 0x808080 && shown(window, 15, 15) == 0xff0000,
+        "scheduled frame reaches the window");
+
+    int         before = atomic_load(&frames);
+    atomic_store(&hold, true);
+    pgsdlrequest(s);
+    while (atomic_load(&frames) == before)
+        SDL_Delay(1);
+    for (int i = 0; i < 10; i++)
+        pgsdlrequest(s);
+    atomic_store(&hold, false);
+    check(showframes(s) == 2 && atomic_load(&frames) == before + 2,
+        "requests during a frame coalesce into one");
+
+    pgsdlstop(s);
+}
+
+int main(void) {
+    SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        fprintf(stderr, "SDL_Init: %s\n", SDL_GetError());
+        return 1;
+    }
+    SDL_Window  *window = SDL_CreateWindow("sdlcheck",
+        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 200, 100, 0);
+    if (!window) {
+        fprintf(stderr, "SDL_CreateWindow: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    presenter(window);
+    scheduler(window);
+
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    return failures != 0;
+}